@@ -0,0 +1,15 @@
+# Writes the benchmark corpus to the given directory, as input for the
+# native benchmark in bench/native.
+#
+#     mix run bench/corpus.exs _build/bench/corpus
+
+Code.require_file("support/corpus.exs", __DIR__)
+
+[dir] = System.argv()
+File.mkdir_p!(dir)
+
+for {name, _kind, html} <- Bench.Corpus.documents() do
+  path = Path.join(dir, "#{name}.html")
+  File.write!(path, html)
+  IO.puts("#{path} (#{div(byte_size(html), 1024)} KiB)")
+end
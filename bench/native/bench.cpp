@@ -0,0 +1,417 @@
+// Benchmarks the tree walker and the serializers from c_src/tree.hpp
+// directly on lexbor documents, without the VM, so that changes to the
+// hot paths can be measured in isolation.
+//
+//     make -C bench/native run
+//
+// or, with any set of HTML files:
+//
+//     make -C bench/native
+//     _build/bench/native_bench page.html ...
+//
+// Every allocation is counted, both by lexbor and by the C++ code, and
+// reported per call.
+//
+// The walker and the serializer are also compared with recursive
+// reference implementations, equivalent to the ones they replaced, so
+// that the cost of the explicit stack is visible at ordinary depths.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <lexbor/core/lexbor.h>
+#include <lexbor/html/html.h>
+
+#include "tree.hpp"
+
+namespace
+{
+  std::atomic<uint64_t> allocation_count{0};
+
+  void *counting_malloc(size_t size)
+  {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size);
+  }
+
+  void *counting_realloc(void *pointer, size_t size)
+  {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return realloc(pointer, size);
+  }
+
+  void *counting_calloc(size_t count, size_t size)
+  {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return calloc(count, size);
+  }
+} // namespace
+
+void *operator new(size_t size)
+{
+  auto pointer = counting_malloc(size);
+  if (pointer == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void operator delete(void *pointer) noexcept { free(pointer); }
+
+void operator delete(void *pointer, size_t) noexcept { free(pointer); }
+
+namespace
+{
+  const double min_time_s = 0.5;
+
+  // Results of the benchmarked calls are added here, so that the
+  // compiler cannot optimize the calls away.
+  volatile size_t sink = 0;
+
+  struct Result
+  {
+    double seconds_per_call;
+    double allocations_per_call;
+  };
+
+  // Runs fun repeatedly for at least min_time_s.
+  Result measure(const std::function<void()> &fun)
+  {
+    fun();
+
+    auto allocations_before = allocation_count.load();
+    auto start = std::chrono::steady_clock::now();
+    uint64_t calls = 0;
+    double elapsed = 0;
+
+    while (elapsed < min_time_s)
+    {
+      fun();
+      calls++;
+      elapsed = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    }
+
+    auto allocations = allocation_count.load() - allocations_before;
+
+    return Result{elapsed / calls, static_cast<double>(allocations) / calls};
+  }
+
+  void report(const char *label, const Result &result, size_t input_size,
+              size_t num_nodes)
+  {
+    printf("  %-34s %10.1fµs %10.1f MB/s %10.1fM nodes/s %12.1f allocs\n",
+           label, result.seconds_per_call * 1e6,
+           input_size / result.seconds_per_call / 1e6,
+           num_nodes / result.seconds_per_call / 1e6,
+           result.allocations_per_call);
+  }
+
+  // Recursive implementations, kept as a baseline for TreeWalker and
+  // HtmlSerializer. They only differ in the traversal, the node output
+  // uses the same helpers.
+  namespace reference
+  {
+    void walk(lxb_dom_node_t *node, size_t depth)
+    {
+      sink += depth;
+
+      for (auto child = lazy_html::template_aware_first_child(node);
+           child != NULL; child = lxb_dom_node_next(child))
+      {
+        walk(child, depth + 1);
+      }
+    }
+
+    void append_node_html(lxb_dom_node_t *node, bool skip_whitespace_nodes,
+                          std::string &html)
+    {
+      if (node->type == LXB_DOM_NODE_TYPE_TEXT)
+      {
+        auto character_data = lxb_dom_interface_character_data(node);
+
+        auto whitespace_size = lazy_html::leading_whitespace_size(
+            character_data->data.data, character_data->data.length);
+
+        if (whitespace_size == character_data->data.length &&
+            skip_whitespace_nodes)
+        {
+          // Append nothing
+        }
+        else if (lazy_html::is_noescape_text_node(node))
+        {
+          html.append(reinterpret_cast<char *>(character_data->data.data),
+                      character_data->data.length);
+        }
+        else
+        {
+          lazy_html::append_escaping(html, character_data->data.data,
+                                     character_data->data.length,
+                                     whitespace_size);
+        }
+      }
+      else if (node->type == LXB_DOM_NODE_TYPE_COMMENT)
+      {
+        auto character_data = lxb_dom_interface_character_data(node);
+        html.append("<!--");
+        html.append(reinterpret_cast<char *>(character_data->data.data),
+                    character_data->data.length);
+        html.append("-->");
+      }
+      else if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+      {
+        auto element = lxb_dom_interface_element(node);
+        size_t name_length;
+        auto name = lxb_dom_element_qualified_name(element, &name_length);
+        html.append("<");
+        html.append(reinterpret_cast<const char *>(name), name_length);
+
+        for (auto attribute = lxb_dom_element_first_attribute(element);
+             attribute != NULL;
+             attribute = lxb_dom_element_next_attribute(attribute))
+        {
+          html.append(" ");
+
+          size_t attr_name_length;
+          auto attr_name =
+              lxb_dom_attr_qualified_name(attribute, &attr_name_length);
+          html.append(reinterpret_cast<const char *>(attr_name),
+                      attr_name_length);
+
+          html.append("=\"");
+
+          size_t value_length;
+          auto value = lxb_dom_attr_value(attribute, &value_length);
+          lazy_html::append_escaping(html, value, value_length);
+
+          html.append("\"");
+        }
+
+        if (lxb_html_node_is_void(node))
+        {
+          html.append("/>");
+        }
+        else
+        {
+          html.append(">");
+          for (auto child = lazy_html::template_aware_first_child(node);
+               child != NULL; child = lxb_dom_node_next(child))
+          {
+            append_node_html(child, skip_whitespace_nodes, html);
+          }
+          html.append("</");
+          html.append(reinterpret_cast<const char *>(name), name_length);
+          html.append(">");
+        }
+      }
+    }
+  } // namespace reference
+
+  // Recursion deeper than this may overflow the stack, so the
+  // recursive references are skipped for such documents.
+  const size_t max_reference_depth = 1000;
+
+  lxb_html_document_t *parse(const std::string &html)
+  {
+    auto document = lxb_html_document_create();
+    if (document == NULL)
+    {
+      fprintf(stderr, "failed to create document\n");
+      exit(1);
+    }
+
+    auto status = lxb_html_document_parse(
+        document, reinterpret_cast<const lxb_char_t *>(html.data()),
+        html.size());
+    if (status != LXB_STATUS_OK)
+    {
+      fprintf(stderr, "failed to parse document\n");
+      exit(1);
+    }
+
+    return document;
+  }
+
+  std::vector<lxb_dom_node_t *> top_level_nodes(lxb_html_document_t *document)
+  {
+    auto nodes = std::vector<lxb_dom_node_t *>();
+    for (auto node = lxb_dom_node_first_child(lxb_dom_interface_node(document));
+         node != NULL; node = lxb_dom_node_next(node))
+    {
+      nodes.push_back(node);
+    }
+    return nodes;
+  }
+
+  void run(const char *path)
+  {
+    auto file = std::ifstream(path, std::ios::binary);
+    if (!file)
+    {
+      fprintf(stderr, "failed to read %s\n", path);
+      exit(1);
+    }
+    auto html = std::string(std::istreambuf_iterator<char>(file),
+                            std::istreambuf_iterator<char>());
+
+    auto document = parse(html);
+    auto roots = top_level_nodes(document);
+
+    size_t num_nodes = 0;
+    size_t max_depth = 0;
+    auto walker = lazy_html::TreeWalker(roots);
+    while (walker.next())
+    {
+      if (walker.event() == lazy_html::TreeWalker::ENTER)
+      {
+        num_nodes++;
+        max_depth = std::max(max_depth, walker.depth());
+      }
+    }
+    auto with_reference = max_depth <= max_reference_depth;
+
+    printf("%s (%zu KiB, %zu nodes)\n", path, html.size() / 1024, num_nodes);
+
+    auto parse_and_destroy = [&]()
+    {
+      lxb_html_document_destroy(parse(html));
+    };
+    report("parse", measure(parse_and_destroy), html.size(), num_nodes);
+
+    auto walk = [&]()
+    {
+      auto walker = lazy_html::TreeWalker(roots);
+      while (walker.next())
+      {
+        sink += walker.depth();
+      }
+    };
+    report("TreeWalker", measure(walk), html.size(), num_nodes);
+
+    if (with_reference)
+    {
+      auto walk_recursive = [&]()
+      {
+        for (auto root : roots)
+        {
+          reference::walk(root, 0);
+        }
+      };
+      report("  recursive reference", measure(walk_recursive), html.size(),
+             num_nodes);
+    }
+
+    for (auto skip_whitespace_nodes : {false, true})
+    {
+      auto serialize = [&]()
+      {
+        auto serializer = lazy_html::HtmlSerializer<std::string>(
+            roots, skip_whitespace_nodes);
+        serializer.run(SIZE_MAX);
+        sink += serializer.html.size();
+      };
+      report(skip_whitespace_nodes ? "HtmlSerializer (skip whitespace)"
+                                   : "HtmlSerializer",
+             measure(serialize), html.size(), num_nodes);
+
+      if (with_reference)
+      {
+        auto serialize_recursive = [&]()
+        {
+          auto output = std::string();
+          for (auto root : roots)
+          {
+            reference::append_node_html(root, skip_whitespace_nodes, output);
+          }
+          sink += output.size();
+        };
+        report("  recursive reference", measure(serialize_recursive),
+               html.size(), num_nodes);
+      }
+    }
+
+    // Repeated serialization of the same roots, served from the cache
+    // after the first call.
+    auto cache = lazy_html::SubtreeCache(SIZE_MAX);
+    auto serialize_memoized = [&]()
+    {
+      auto serializer = lazy_html::HtmlSerializer<std::string>(roots, false);
+      serializer.set_cache(&cache);
+      serializer.run(SIZE_MAX);
+      sink += serializer.html.size();
+    };
+    report("HtmlSerializer (memoized)", measure(serialize_memoized),
+           html.size(), num_nodes);
+
+    auto visible_options = lazy_html::TextOptions();
+    visible_options.visible_only = true;
+    visible_options.block_separator = "\n";
+    visible_options.collapse_whitespace = true;
+
+    for (auto visible : {false, true})
+    {
+      auto options = visible ? visible_options : lazy_html::TextOptions();
+      auto write_text = [&]()
+      {
+        auto text = std::string();
+        auto writer = lazy_html::TextWriter<std::string>(text, options);
+        writer.write(roots);
+        sink += text.size();
+      };
+      report(visible ? "TextWriter (visible)" : "TextWriter",
+             measure(write_text), html.size(), num_nodes);
+    }
+
+    // Escapes the whole input, which gives the raw throughput of the
+    // escaping kernels.
+    for (auto scalar : {true, false})
+    {
+      auto kernels = scalar ? lazy_html::simd::scalar_kernels()
+                            : lazy_html::simd::kernels;
+      auto escape = [&]()
+      {
+        auto escaped = std::string();
+        lazy_html::append_escaping(
+            escaped, reinterpret_cast<const unsigned char *>(html.data()),
+            html.size(), 0, kernels);
+        sink += escaped.size();
+      };
+      report(scalar ? "append_escaping (scalar)" : "append_escaping",
+             measure(escape), html.size(), num_nodes);
+    }
+
+    lxb_html_document_destroy(document);
+
+    printf("\n");
+  }
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s file.html ...\n", argv[0]);
+    return 1;
+  }
+
+  // Routes lexbor allocations through the counters as well.
+  lexbor_memory_setup(counting_malloc, counting_realloc, counting_calloc, free);
+
+  for (int i = 1; i < argc; i++)
+  {
+    run(argv[i]);
+  }
+
+  return 0;
+}
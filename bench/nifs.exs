@@ -0,0 +1,173 @@
+# Measures every NIF on the benchmark corpus, see bench/support/corpus.exs.
+#
+#     mix run bench/nifs.exs
+#
+# For every operation it reports the time per call, the throughput in
+# MB/s of input HTML and in nodes/s, and the memory allocated for the
+# result: on the process heap, in off-heap binaries and in native
+# documents. Functions that only configure the library, such as pool
+# sizes, and the debug kernels are not included.
+
+Code.require_file("support/corpus.exs", __DIR__)
+
+defmodule Bench do
+  @min_time_us 200_000
+
+  # Runs fun repeatedly for at least @min_time_us and returns the
+  # average time per call, in microseconds.
+  def measure(fun) do
+    fun.()
+    measure(fun, 0, 0)
+  end
+
+  defp measure(fun, iterations, elapsed) when elapsed >= @min_time_us do
+    elapsed / iterations
+  end
+
+  defp measure(fun, iterations, elapsed) do
+    {time, _} = :timer.tc(fun)
+    measure(fun, iterations + 1, elapsed + time)
+  end
+
+  # Returns the bytes allocated for the result of fun, on the process
+  # heap, in off-heap binaries and in native documents. We measure in
+  # a fresh process, so that other garbage does not get in the way.
+  def allocations(fun) do
+    task =
+      Task.async(fn ->
+        binary_before = :erlang.memory(:binary)
+        %{bytes: native_before} = LazyHTML.memory()
+
+        result = fun.()
+
+        heap = :erts_debug.size(result) * :erlang.system_info(:wordsize)
+        binary = max(:erlang.memory(:binary) - binary_before, 0)
+        %{bytes: native} = LazyHTML.memory()
+
+        {heap, binary, max(native - native_before, 0)}
+      end)
+
+    Task.await(task, :infinity)
+  end
+
+  def count_nodes(tree) do
+    Enum.reduce(tree, 0, fn
+      {_tag, _attrs, children}, acc -> acc + 1 + count_nodes(children)
+      _leaf, acc -> acc + 1
+    end)
+  end
+
+  def chunks(html, size) when byte_size(html) <= size, do: [html]
+
+  def chunks(html, size) do
+    <<chunk::binary-size(size), rest::binary>> = html
+    [chunk | chunks(rest, size)]
+  end
+
+  def format_row(label, time, bytes, nodes, {heap, binary, native}) do
+    [
+      "  ",
+      String.pad_trailing(label, 22),
+      String.pad_leading("#{Float.round(time, 1)}µs", 14),
+      String.pad_leading("#{Float.round(bytes / time, 1)} MB/s", 14),
+      String.pad_leading("#{format_count(nodes / time * 1_000_000)} nodes/s", 18),
+      String.pad_leading(format_bytes(heap), 12),
+      String.pad_leading(format_bytes(binary), 12),
+      String.pad_leading(format_bytes(native), 12)
+    ]
+  end
+
+  defp format_count(count) when count >= 1_000_000, do: "#{Float.round(count / 1_000_000, 1)}M"
+  defp format_count(count) when count >= 1_000, do: "#{Float.round(count / 1_000, 1)}k"
+  defp format_count(count), do: "#{round(count)}"
+
+  defp format_bytes(bytes) when bytes >= 1024 * 1024,
+    do: "#{Float.round(bytes / (1024 * 1024), 1)} MiB"
+
+  defp format_bytes(bytes) when bytes >= 1024, do: "#{Float.round(bytes / 1024, 1)} KiB"
+  defp format_bytes(bytes), do: "#{bytes} B"
+end
+
+for {name, kind, html} <- Bench.Corpus.documents() do
+  lazy_html =
+    case kind do
+      :document -> LazyHTML.from_document(html)
+      :fragment -> LazyHTML.from_fragment(html)
+    end
+
+  tree = LazyHTML.to_tree(lazy_html)
+  num_nodes = Bench.count_nodes(tree)
+  elements = LazyHTML.query(lazy_html, "*")
+  links = LazyHTML.query(lazy_html, "a")
+  # Roots without nested roots, so that the copied subtrees do not
+  # overlap, even in deeply nested documents.
+  leaves = LazyHTML.query(lazy_html, "p, li, td, span")
+  chunks = Bench.chunks(html, 64 * 1024)
+  batch = List.duplicate(html, 8)
+
+  IO.puts("#{name} (#{div(byte_size(html), 1024)} KiB, #{num_nodes} nodes)")
+
+  IO.puts([
+    "  ",
+    String.pad_trailing("", 22),
+    String.pad_leading("time", 14),
+    String.pad_leading("input", 14),
+    String.pad_leading("nodes", 18),
+    String.pad_leading("heap", 12),
+    String.pad_leading("binary", 12),
+    String.pad_leading("native", 12)
+  ])
+
+  operations = [
+    {"from_document/1", fn -> LazyHTML.from_document(html) end},
+    {"from_fragment/1", fn -> LazyHTML.from_fragment(html) end},
+    {"from_stream/1", fn -> LazyHTML.from_stream(chunks) end},
+    {"from_tree/1", fn -> LazyHTML.from_tree(tree) end},
+    {"to_html/2", fn -> LazyHTML.to_html(lazy_html) end},
+    {"to_html/2 (chunked)", fn -> LazyHTML.to_html(lazy_html, chunk_size: 64 * 1024) end},
+    {"to_html/2 (memoized)", fn -> LazyHTML.to_html(leaves, memoize: true) end},
+    {"to_html_stream/2", fn -> lazy_html |> LazyHTML.to_html_stream() |> Stream.run() end},
+    {"to_tree/2", fn -> LazyHTML.to_tree(lazy_html) end},
+    {"text/2", fn -> LazyHTML.text(lazy_html) end},
+    {"text/2 (visible)",
+     fn ->
+       LazyHTML.text(lazy_html,
+         visible_only: true,
+         block_separator: "\n",
+         collapse_whitespace: true
+       )
+     end},
+    {"query/2 (tag)", fn -> LazyHTML.query(lazy_html, "a") end},
+    {"query/2 (complex)", fn -> LazyHTML.query(lazy_html, "ul > li:first-child a[href]") end},
+    {"query_many/2", fn -> LazyHTML.query_many(lazy_html, ["a", "p", "td.c1", "span"]) end},
+    {"query_by_id/2", fn -> LazyHTML.query_by_id(lazy_html, "target") end},
+    {"filter/2", fn -> LazyHTML.filter(elements, "a, td") end},
+    {"child_nodes/1", fn -> LazyHTML.child_nodes(elements) end},
+    {"attribute/2", fn -> LazyHTML.attribute(links, "href") end},
+    {"attributes/1", fn -> LazyHTML.attributes(elements) end},
+    {"tag/1", fn -> LazyHTML.tag(elements) end},
+    {"extract/3",
+     fn ->
+       LazyHTML.extract(lazy_html, links: {"a", {:attr, "href"}}, cells: {"li, td", :text})
+     end},
+    {"detach/1", fn -> LazyHTML.detach(leaves) end},
+    # Copies the shared document, then modifies the copy.
+    {"set_attribute/3", fn -> LazyHTML.set_attribute(links, "rel", "nofollow") end},
+    {"Enum.count/1", fn -> Enum.count(elements) end},
+    {"Enum.to_list/1", fn -> Enum.to_list(elements) end},
+    {"memory/1", fn -> LazyHTML.memory(lazy_html) end}
+  ]
+
+  for {label, fun} <- operations do
+    time = Bench.measure(fun)
+    allocations = Bench.allocations(fun)
+    IO.puts(Bench.format_row(label, time, byte_size(html), num_nodes, allocations))
+  end
+
+  # Reported per document, so it is comparable with from_document/1.
+  time = Bench.measure(fn -> LazyHTML.from_documents(batch) end) / length(batch)
+  allocations = Bench.allocations(fn -> LazyHTML.from_documents(batch) end)
+  IO.puts(Bench.format_row("from_documents/2", time, byte_size(html), num_nodes, allocations))
+
+  IO.puts("")
+end
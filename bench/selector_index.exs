@@ -0,0 +1,57 @@
+# Compares query/2 on a large document before and after the selector
+# index is built.
+#
+#     mix run bench/selector_index.exs
+
+defmodule Bench do
+  def measure(fun, iterations) do
+    {time, _} = :timer.tc(fn -> for _ <- 1..iterations, do: fun.() end)
+    time / iterations
+  end
+
+  def document(num_cards) do
+    cards =
+      for i <- 1..num_cards do
+        """
+        <div class="card" data-testid="card-#{i}">
+          <h2 class="title">Product #{i}</h2>
+          <p class="description">Lorem ipsum <b>dolor</b> sit amet</p>
+          <span class="price">#{i}.99</span>
+          <a href="/products/#{i}">Details</a>
+        </div>
+        """
+      end
+
+    "<html><body>#{cards}</body></html>"
+  end
+end
+
+iterations = 50
+selectors = ["a", ".price", ~S|[data-testid="card-500"]|, "div.card", "span.price"]
+
+for num_cards <- [1_000, 10_000] do
+  html = Bench.document(num_cards)
+
+  IO.puts("#{num_cards} cards (#{div(byte_size(html), 1024)} KiB)")
+
+  for selector <- selectors do
+    # Every query parses a new document, so the index is never built
+    unindexed =
+      Bench.measure(
+        fn -> LazyHTML.query(LazyHTML.from_document(html), selector) end,
+        iterations
+      ) -
+        Bench.measure(fn -> LazyHTML.from_document(html) end, iterations)
+
+    lazy_html = LazyHTML.from_document(html)
+    for _ <- 1..5, do: LazyHTML.query(lazy_html, selector)
+
+    indexed = Bench.measure(fn -> LazyHTML.query(lazy_html, selector) end, iterations)
+
+    IO.puts(
+      "  #{String.pad_trailing(selector, 28)}" <>
+        "walk: #{round(unindexed)}µs  index: #{round(indexed)}µs  " <>
+        "(#{Float.round(unindexed / indexed, 1)}x)"
+    )
+  end
+end
@@ -0,0 +1,119 @@
+# A deterministic corpus of generated documents shared by the
+# benchmarks. The documents are generated from a fixed seed, so every
+# run measures exactly the same input.
+
+defmodule Bench.Corpus do
+  @words ~w(lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod
+            tempor incididunt ut labore et dolore magna aliqua enim ad minim veniam
+            quis nostrud exercitation ullamco laboris nisi aliquip ex ea commodo)
+
+  @doc """
+  Returns a list of `{name, kind, html}` tuples, where kind is either
+  `:document` or `:fragment`.
+  """
+  def documents() do
+    :rand.seed(:exsss, {1, 2, 3})
+
+    [
+      {"fragment", :fragment, fragment()},
+      {"article", :document, article(40)},
+      {"table", :document, table(10_000, 8)},
+      {"nested", :document, nested(20, 500)},
+      {"deep", :document, nested(10_000, 1)}
+    ]
+  end
+
+  # A small component, as rendered by a template.
+  defp fragment() do
+    """
+    <div class="card" id="target">
+      <h2 class="title">#{sentence(4)}</h2>
+      <p class="description">#{sentence(20)} <b>#{sentence(2)}</b> &amp; #{sentence(8)}</p>
+      <ul class="tags">#{for i <- 1..5, do: ~s|<li><a href="/tags/#{i}">#{word()}</a></li>|}</ul>
+      <span class="price" data-currency="EUR">19.99</span>
+    </div>
+    """
+  end
+
+  # A typical article page, with scripts and styles in the head,
+  # navigation, paragraphs with inline markup, lists and figures.
+  defp article(num_sections) do
+    sections =
+      for i <- 1..num_sections do
+        """
+        <section id="section-#{i}">
+          <h2>#{sentence(5)}</h2>
+          <p>#{sentence(40)} <a href="/articles/#{i}">#{sentence(3)}</a> #{sentence(30)}</p>
+          <p>#{sentence(25)} <em>#{sentence(2)}</em>, <code>x &lt; #{i}</code> #{sentence(25)}</p>
+          <!-- section #{i} -->
+          <figure><img src="/images/#{i}.png" alt="#{sentence(3)}"><figcaption>#{sentence(6)}</figcaption></figure>
+          <ul>#{for j <- 1..4, do: ~s|<li class="item-#{j}">#{sentence(6)}</li>|}</ul>
+        </section>
+        """
+      end
+
+    """
+    <!DOCTYPE html>
+    <html lang="en">
+    <head>
+      <meta charset="utf-8">
+      <title>#{sentence(6)}</title>
+      <link rel="stylesheet" href="/app.css">
+      <style>body { margin: 0 } .nav > li { display: inline-block }</style>
+      <script>window.dataLayer = [{"page": "article", "id": 42}];</script>
+    </head>
+    <body>
+      <nav><ul class="nav">#{for i <- 1..10, do: ~s|<li><a href="/#{i}">#{word()}</a></li>|}</ul></nav>
+      <main>
+        <article id="target">
+          <h1>#{sentence(8)}</h1>
+          #{sections}
+        </article>
+      </main>
+      <footer><p>#{sentence(12)}</p></footer>
+    </body>
+    </html>
+    """
+  end
+
+  # A large data table, such as a report or a listing.
+  defp table(num_rows, num_columns) do
+    header = for i <- 1..num_columns, do: "<th>Column #{i}</th>"
+
+    rows =
+      for i <- 1..num_rows do
+        cells =
+          for j <- 1..num_columns do
+            ~s|<td class="c#{j}" data-value="#{:rand.uniform(10_000)}">#{word()}</td>|
+          end
+
+        id = if i == div(num_rows, 2), do: "target", else: "row-#{i}"
+        ~s|<tr id="#{id}">#{cells}</tr>\n|
+      end
+
+    """
+    <html><body>
+    <table>
+      <thead><tr>#{header}</tr></thead>
+      <tbody>
+    #{rows}  </tbody>
+    </table>
+    </body></html>
+    """
+  end
+
+  # Repeated blocks of nested elements, each depth levels deep.
+  defp nested(depth, count) do
+    block =
+      String.duplicate(~s|<div class="level"><span>#{word()}</span>|, depth) <>
+        String.duplicate("</div>", depth)
+
+    ~s|<html><body><div id="target"></div>#{String.duplicate(block, count)}</body></html>|
+  end
+
+  defp sentence(num_words) do
+    Enum.map_join(1..num_words, " ", fn _ -> word() end)
+  end
+
+  defp word(), do: Enum.random(@words)
+end
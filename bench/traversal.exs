@@ -0,0 +1,61 @@
+# Measures functions that walk whole subtrees on documents of ordinary
+# and extreme depth.
+#
+#     mix run bench/traversal.exs
+#
+# These are absolute timings. For a side by side comparison of the walker
+# and the serializer with the recursive implementations they replaced,
+# on the same wide (table) and depth 20 (nested) documents, run the
+# native benchmark:
+#
+#     make -C bench/native run
+
+defmodule Bench do
+  def measure(fun, iterations) do
+    {time, _} = :timer.tc(fn -> for _ <- 1..iterations, do: fun.() end)
+    time / iterations
+  end
+
+  # A page-like document, with many siblings and little nesting.
+  def wide(num_items) do
+    items =
+      for i <- 1..num_items do
+        ~s|<li id="item-#{i}" class="item"><a href="/#{i}">Item <b>#{i}</b></a> &amp; more</li>|
+      end
+
+    "<html><body><ul>#{items}</ul></body></html>"
+  end
+
+  def deep(depth) do
+    String.duplicate("<div><span>x</span>", depth) <> String.duplicate("</div>", depth)
+  end
+end
+
+iterations = 20
+
+documents = [
+  {"wide, 10k items", Bench.wide(10_000)},
+  {"nested, depth 20", Bench.deep(20) |> String.duplicate(500)},
+  {"nested, depth 10k", Bench.deep(10_000)}
+]
+
+for {name, html} <- documents do
+  lazy_html = LazyHTML.from_document(html)
+
+  IO.puts("#{name} (#{div(byte_size(html), 1024)} KiB)")
+
+  for {label, fun} <- [
+        {"to_html/2", fn -> LazyHTML.to_html(lazy_html) end},
+        {"to_tree/2", fn -> LazyHTML.to_tree(lazy_html) end},
+        {"text/1", fn -> LazyHTML.text(lazy_html) end},
+        {"query_by_id/2", fn -> LazyHTML.query_by_id(lazy_html, "item-5000") end},
+        {"detach/1", fn -> LazyHTML.detach(lazy_html) end}
+      ] do
+    time = Bench.measure(fun, iterations)
+    mb_per_s = byte_size(html) / time
+
+    IO.puts(
+      "  #{String.pad_trailing(label, 16)}#{round(time)}µs  (#{Float.round(mb_per_s, 1)} MB/s)"
+    )
+  end
+end
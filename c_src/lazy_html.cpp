@@ -1,16 +1,27 @@
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <erl_nif.h>
 #include <fine.hpp>
 #include <functional>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
 #include <variant>
 
 #include <lexbor/html/html.h>
 
+#include "simd.hpp"
+#include "tree.hpp"
+
 namespace lazy_html
 {
 
@@ -39,803 +50,3439 @@ namespace lazy_html
   namespace atoms
   {
     auto ElixirLazyHTML = fine::Atom("Elixir.LazyHTML");
+    auto ElixirLazyHTMLParser = fine::Atom("Elixir.LazyHTML.Parser");
+    auto ElixirLazyHTMLSelector = fine::Atom("Elixir.LazyHTML.Selector");
+    auto append_html = fine::Atom("append_html");
+    auto attr = fine::Atom("attr");
     auto comment = fine::Atom("comment");
+    auto cont = fine::Atom("cont");
+    auto count = fine::Atom("count");
+    auto done = fine::Atom("done");
+    auto error = fine::Atom("error");
+    auto html = fine::Atom("html");
+    auto ok = fine::Atom("ok");
+    auto remove = fine::Atom("remove");
+    auto remove_attribute = fine::Atom("remove_attribute");
+    auto replace_with_html = fine::Atom("replace_with_html");
     auto resource = fine::Atom("resource");
+    auto set_attribute = fine::Atom("set_attribute");
+    auto set_text = fine::Atom("set_text");
+    auto text = fine::Atom("text");
   } // namespace atoms
 
-  struct DocumentRef
+  // Returns a small, stable index identifying the calling thread. We
+  // use it to spread shared state across shards, so that schedulers
+  // running in parallel do not contend on the same lock.
+  size_t current_thread_index()
   {
-    lxb_html_document_t *document;
-
-    DocumentRef(lxb_html_document_t *document) : document(document) {}
+    static std::atomic<size_t> next_index(0);
+    thread_local size_t index = next_index.fetch_add(1);
+    return index;
+  }
 
-    ~DocumentRef() { lxb_html_document_destroy(this->document); }
+  // NIFs with call statistics, see NifStats.
+  enum class NifId
+  {
+    FROM_DOCUMENT,
+    FROM_DOCUMENTS,
+    FROM_FRAGMENT,
+    PARSER_FEED,
+    PARSER_FINISH,
+    FROM_TREE,
+    TO_HTML,
+    TO_HTML_STREAM,
+    TO_TREE,
+    TEXT,
+    DETACH,
+    COMPILE_SELECTOR,
+    QUERY,
+    QUERY_MANY,
+    QUERY_BY_ID,
+    FILTER,
+    CHILD_NODES,
+    NODES,
+    ATTRIBUTE,
+    ATTRIBUTES,
+    TAG,
+    EXTRACT,
+    SET_ATTRIBUTE,
+    REMOVE_ATTRIBUTE,
+    REMOVE,
+    REPLACE_WITH_HTML,
+    APPEND_HTML,
+    SET_TEXT,
+    MODIFY,
+    COUNT
   };
 
-  struct LazyHTML
+  // Indexed by NifId.
+  const char *nif_names[] = {
+      "from_document", "from_documents", "from_fragment", "parser_feed",
+      "parser_finish", "from_tree", "to_html", "to_html_stream",
+      "to_tree", "text", "detach", "compile_selector",
+      "query", "query_many", "query_by_id", "filter",
+      "child_nodes", "nodes", "attribute", "attributes",
+      "tag", "extract", "set_attribute", "remove_attribute",
+      "remove", "replace_with_html", "append_html", "set_text",
+      "modify"};
+
+  constexpr size_t num_nifs = static_cast<size_t>(NifId::COUNT);
+
+  static_assert(sizeof(nif_names) / sizeof(nif_names[0]) == num_nifs);
+
+  // Call statistics of NIFs, for monitoring.
+  //
+  // Counters are sharded by thread and every NIF has its own cache line
+  // within a shard, so recording a call amounts to a few uncontended
+  // relaxed additions. The shards are only summed up when the stats are
+  // read.
+  class NifStats
   {
-    std::shared_ptr<DocumentRef> document_ref;
-    std::vector<lxb_dom_node_t *> nodes;
-    bool from_selector;
-
-    LazyHTML(std::shared_ptr<DocumentRef> document_ref,
-             std::vector<lxb_dom_node_t *> nodes, bool from_selector)
-        : document_ref(document_ref), nodes(nodes), from_selector(from_selector)
+  public:
+    struct alignas(64) Counters
+    {
+      std::atomic<uint64_t> calls{0};
+      std::atomic<uint64_t> bytes_in{0};
+      std::atomic<uint64_t> bytes_out{0};
+      std::atomic<uint64_t> nodes{0};
+      std::atomic<uint64_t> total_time{0};
+      std::atomic<uint64_t> max_time{0};
+    };
+
+    using Totals =
+        std::tuple<fine::Atom, uint64_t, uint64_t, uint64_t, uint64_t,
+                   uint64_t, uint64_t>;
+
+    Counters &local(NifId id)
     {
+      auto &shard = this->shards[current_thread_index() % num_shards];
+      return shard.counters[static_cast<size_t>(id)];
     }
-  };
-
-  FINE_RESOURCE(LazyHTML);
-
-  struct ExLazyHTML
-  {
-    fine::ResourcePtr<LazyHTML> resource;
 
-    ExLazyHTML() {}
-    ExLazyHTML(fine::ResourcePtr<LazyHTML> resource) : resource(resource) {}
+    std::vector<Totals> totals()
+    {
+      auto result = std::vector<Totals>();
 
-    static constexpr auto module = &atoms::ElixirLazyHTML;
+      for (size_t i = 0; i < num_nifs; i++)
+      {
+        uint64_t calls = 0, bytes_in = 0, bytes_out = 0, nodes = 0,
+                 total_time = 0, max_time = 0;
 
-    static constexpr auto fields()
-    {
-      return std::make_tuple(
-          std::make_tuple(&ExLazyHTML::resource, &atoms::resource));
-    }
-  };
+        for (auto &shard : this->shards)
+        {
+          auto &counters = shard.counters[i];
+          calls += counters.calls.load(std::memory_order_relaxed);
+          bytes_in += counters.bytes_in.load(std::memory_order_relaxed);
+          bytes_out += counters.bytes_out.load(std::memory_order_relaxed);
+          nodes += counters.nodes.load(std::memory_order_relaxed);
+          total_time += counters.total_time.load(std::memory_order_relaxed);
+          max_time = std::max(max_time,
+                              counters.max_time.load(std::memory_order_relaxed));
+        }
 
-  ERL_NIF_TERM make_new_binary(ErlNifEnv *env, size_t size,
-                               const unsigned char *data)
-  {
-    ERL_NIF_TERM term;
-    auto term_data = enif_make_new_binary(env, size, &term);
-    memcpy(term_data, data, size);
-    return term;
-  }
+        result.push_back(std::make_tuple(fine::Atom(nif_names[i]), calls,
+                                         bytes_in, bytes_out, nodes,
+                                         total_time, max_time));
+      }
 
-  ExLazyHTML from_document(ErlNifEnv *env, ErlNifBinary html)
-  {
-    auto document = lxb_html_document_create();
-    if (document == NULL)
-    {
-      throw std::runtime_error("failed to create document");
+      return result;
     }
-    auto document_guard =
-        ScopeGuard([&]()
-                   { lxb_html_document_destroy(document); });
 
-    auto status = lxb_html_document_parse(document, html.data, html.size);
-    if (status != LXB_STATUS_OK)
+    void reset()
     {
-      throw std::runtime_error("failed to parse html document");
+      for (auto &shard : this->shards)
+      {
+        for (auto &counters : shard.counters)
+        {
+          counters.calls.store(0, std::memory_order_relaxed);
+          counters.bytes_in.store(0, std::memory_order_relaxed);
+          counters.bytes_out.store(0, std::memory_order_relaxed);
+          counters.nodes.store(0, std::memory_order_relaxed);
+          counters.total_time.store(0, std::memory_order_relaxed);
+          counters.max_time.store(0, std::memory_order_relaxed);
+        }
+      }
     }
 
-    auto document_ref = std::make_shared<DocumentRef>(document);
-    document_guard.deactivate();
+  private:
+    static constexpr size_t num_shards = 16;
 
-    auto nodes = std::vector<lxb_dom_node_t *>();
-    for (auto node = lxb_dom_node_first_child(lxb_dom_interface_node(document));
-         node != NULL; node = lxb_dom_node_next(node))
+    struct Shard
     {
-      nodes.push_back(node);
-    }
+      Counters counters[num_nifs];
+    };
 
-    return ExLazyHTML(fine::make_resource<LazyHTML>(document_ref, nodes, false));
-  }
+    Shard shards[num_shards];
+  };
 
-  FINE_NIF(from_document, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+  NifStats nif_stats;
 
-  ExLazyHTML from_fragment(ErlNifEnv *env, ErlNifBinary html)
+  // Measures a NIF call and records it in nif_stats when it goes out of
+  // scope, including when the NIF raises.
+  //
+  // NIFs that yield record every run separately, but count the call
+  // only once, in the initial run.
+  class NifCall
   {
-    auto document = lxb_html_document_create();
-    if (document == NULL)
-    {
-      throw std::runtime_error("failed to create document");
-    }
-    auto document_guard =
-        ScopeGuard([&]()
-                   { lxb_html_document_destroy(document); });
+  public:
+    NifCall(NifId id, bool initial = true)
+        : counters(nif_stats.local(id)), initial(initial),
+          start(enif_monotonic_time(ERL_NIF_NSEC)) {}
 
-    auto context = lxb_dom_document_create_element(
-        &document->dom_document, reinterpret_cast<const lxb_char_t *>("body"), 4,
-        NULL);
+    NifCall(const NifCall &) = delete;
+    NifCall &operator=(const NifCall &) = delete;
 
-    auto parse_root =
-        lxb_html_document_parse_fragment(document, context, html.data, html.size);
-    if (parse_root == NULL)
+    ~NifCall()
     {
-      throw std::runtime_error("failed to parse html fragment");
-    }
+      auto time =
+          static_cast<uint64_t>(enif_monotonic_time(ERL_NIF_NSEC) - this->start);
 
-    auto document_ref = std::make_shared<DocumentRef>(document);
-    document_guard.deactivate();
+      if (this->initial)
+      {
+        this->counters.calls.fetch_add(1, std::memory_order_relaxed);
+      }
+      if (this->bytes_in > 0)
+      {
+        this->counters.bytes_in.fetch_add(this->bytes_in,
+                                          std::memory_order_relaxed);
+      }
+      if (this->bytes_out > 0)
+      {
+        this->counters.bytes_out.fetch_add(this->bytes_out,
+                                           std::memory_order_relaxed);
+      }
+      if (this->nodes > 0)
+      {
+        this->counters.nodes.fetch_add(this->nodes, std::memory_order_relaxed);
+      }
+      this->counters.total_time.fetch_add(time, std::memory_order_relaxed);
 
-    auto nodes = std::vector<lxb_dom_node_t *>();
-    for (auto node = lxb_dom_node_first_child(parse_root); node != NULL;
-         node = lxb_dom_node_next(node))
-    {
-      nodes.push_back(node);
+      auto max_time = this->counters.max_time.load(std::memory_order_relaxed);
+      while (time > max_time &&
+             !this->counters.max_time.compare_exchange_weak(
+                 max_time, time, std::memory_order_relaxed))
+      {
+      }
     }
 
-    return ExLazyHTML(fine::make_resource<LazyHTML>(document_ref, nodes, false));
-  }
+    void add_bytes_in(size_t size) { this->bytes_in += size; }
 
-  FINE_NIF(from_fragment, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+    void add_bytes_out(size_t size) { this->bytes_out += size; }
 
-  void append_escaping(std::string &html, const unsigned char *data,
-                       size_t length, size_t unescaped_prefix_size = 0)
-  {
-    size_t offset = 0;
-    size_t size = unescaped_prefix_size;
+    void add_nodes(size_t count) { this->nodes += count; }
 
-    for (size_t i = unescaped_prefix_size; i < length; ++i)
+  private:
+    NifStats::Counters &counters;
+    bool initial;
+    ErlNifTime start;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t nodes = 0;
+  };
+
+  // Recycles lexbor documents across parses.
+  //
+  // Creating a document allocates its memory arenas, its hash tables
+  // and, on the first parse, the HTML parser, which the document keeps
+  // for subsequent parses. Once a document is no longer referenced, we
+  // clean it and keep it around, so that the next parse reuses all of
+  // that instead of allocating it again. Cleaning keeps only the first
+  // chunk of each arena, so pooled documents stay small regardless of
+  // the size of the page they held before.
+  //
+  // The pool is sharded by thread, which in practice gives each dirty
+  // scheduler its own set of documents.
+  class DocumentPool
+  {
+  public:
+    lxb_html_document_t *acquire()
     {
-      auto ch = data[i];
-      if (ch == '<')
-      {
-        if (size > 0)
-        {
-          html.append(reinterpret_cast<const char *>(data + offset), size);
-        }
-        offset = i + 1;
-        size = 0;
-        html.append("&lt;");
-      }
-      else if (ch == '>')
+      auto &shard = this->shards[current_thread_index() % num_shards];
+
       {
-        if (size > 0)
+        auto lock = std::lock_guard<std::mutex>(shard.mutex);
+
+        if (!shard.documents.empty())
         {
-          html.append(reinterpret_cast<const char *>(data + offset), size);
+          auto document = shard.documents.back();
+          shard.documents.pop_back();
+          this->hits.fetch_add(1, std::memory_order_relaxed);
+          return document;
         }
-        offset = i + 1;
-        size = 0;
-        html.append("&gt;");
       }
-      else if (ch == '&')
+
+      this->misses.fetch_add(1, std::memory_order_relaxed);
+
+      auto document = lxb_html_document_create();
+      if (document == NULL)
       {
-        if (size > 0)
-        {
-          html.append(reinterpret_cast<const char *>(data + offset), size);
-        }
-        offset = i + 1;
-        size = 0;
-        html.append("&amp;");
+        throw std::runtime_error("failed to create document");
       }
-      else if (ch == '"')
+
+      return document;
+    }
+
+    void release(lxb_html_document_t *document)
+    {
+      auto &shard = this->shards[current_thread_index() % num_shards];
+      auto max_shard_size = this->max_shard_size.load(std::memory_order_relaxed);
+
       {
-        if (size > 0)
+        auto lock = std::lock_guard<std::mutex>(shard.mutex);
+
+        if (shard.documents.size() < max_shard_size)
         {
-          html.append(reinterpret_cast<const char *>(data + offset), size);
+          lxb_html_document_clean(document);
+          // Cleaning does not reset the compatibility mode determined
+          // by the previous parse, so we restore the initial one.
+          document->dom_document.compat_mode = LXB_DOM_DOCUMENT_CMODE_NO_QUIRKS;
+          shard.documents.push_back(document);
+          return;
         }
-        offset = i + 1;
-        size = 0;
-        html.append("&quot;");
       }
-      else if (ch == '\'')
+
+      lxb_html_document_destroy(document);
+    }
+
+    // Sets the maximum number of idle documents kept in the pool.
+    void set_max_size(size_t max_size)
+    {
+      auto max_shard_size = (max_size + num_shards - 1) / num_shards;
+      this->max_shard_size.store(max_shard_size, std::memory_order_relaxed);
+
+      for (auto &shard : this->shards)
       {
-        if (size > 0)
+        auto lock = std::lock_guard<std::mutex>(shard.mutex);
+
+        while (shard.documents.size() > max_shard_size)
         {
-          html.append(reinterpret_cast<const char *>(data + offset), size);
+          lxb_html_document_destroy(shard.documents.back());
+          shard.documents.pop_back();
         }
-        offset = i + 1;
-        size = 0;
-        html.append("&#39;");
       }
-      else
+    }
+
+    std::tuple<uint64_t, uint64_t, uint64_t> stats()
+    {
+      uint64_t size = 0;
+
+      for (auto &shard : this->shards)
       {
-        size++;
+        auto lock = std::lock_guard<std::mutex>(shard.mutex);
+        size += shard.documents.size();
       }
+
+      return std::make_tuple(this->hits.load(std::memory_order_relaxed),
+                             this->misses.load(std::memory_order_relaxed),
+                             size);
     }
 
-    if (size > 0)
+  private:
+    static constexpr size_t num_shards = 16;
+
+    struct alignas(64) Shard
     {
-      html.append(reinterpret_cast<const char *>(data + offset), size);
-    }
-  }
+      std::mutex mutex;
+      std::vector<lxb_html_document_t *> documents;
+    };
+
+    Shard shards[num_shards];
+    std::atomic<size_t> max_shard_size{4};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+  };
 
-  bool is_noescape_text_node(lxb_dom_node_t *node)
+  DocumentPool document_pool;
+
+  std::vector<lxb_dom_node_t *> child_nodes_of(lxb_dom_node_t *node)
   {
-    if (node->parent != NULL)
+    auto nodes = std::vector<lxb_dom_node_t *>();
+    for (auto child = lxb_dom_node_first_child(node); child != NULL;
+         child = lxb_dom_node_next(child))
     {
-      switch (node->parent->local_name)
-      {
-      case LXB_TAG_STYLE:
-      case LXB_TAG_SCRIPT:
-      case LXB_TAG_XMP:
-      case LXB_TAG_IFRAME:
-      case LXB_TAG_NOEMBED:
-      case LXB_TAG_NOFRAMES:
-      case LXB_TAG_PLAINTEXT:
-        return true;
-      }
+      nodes.push_back(child);
     }
-
-    return false;
+    return nodes;
   }
 
-  size_t leading_whitespace_size(const unsigned char *data, size_t length)
+  // Returns the value of the id attribute of the given node, or nullopt
+  // if the node is not an element or it has no id.
+  std::optional<std::string_view> element_id(lxb_dom_node_t *node)
   {
-    auto size = 0;
-
-    for (size_t i = 0; i < length; i++)
+    if (node->type != LXB_DOM_NODE_TYPE_ELEMENT)
     {
-      auto ch = data[i];
+      return std::nullopt;
+    }
 
-      if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r')
-      {
-        size++;
-      }
-      else
-      {
-        return size;
-      }
+    size_t value_length;
+    auto value = lxb_dom_element_get_attribute(
+        lxb_dom_interface_element(node),
+        reinterpret_cast<const lxb_char_t *>("id"), 2, &value_length);
+
+    if (value == NULL)
+    {
+      return std::nullopt;
     }
 
-    return size;
+    return std::string_view(reinterpret_cast<const char *>(value),
+                            value_length);
   }
 
-  lxb_dom_node_t *template_aware_first_child(lxb_dom_node_t *node)
+  std::string ascii_lowercase(const lxb_char_t *data, size_t length)
   {
-    if (lxb_html_tree_node_is(node, LXB_TAG_TEMPLATE))
-    {
-      // <template> elements don't have direct children, instead they hold
-      // a document fragment node, so we reach for its first child instead.
-      return lxb_html_interface_template(node)->content->node.first_child;
-    }
-    else
+    auto string = std::string(reinterpret_cast<const char *>(data), length);
+    for (auto &ch : string)
     {
-      return lxb_dom_node_first_child(node);
+      if (ch >= 'A' && ch <= 'Z')
+      {
+        ch = ch - 'A' + 'a';
+      }
     }
+    return string;
   }
 
-  void append_node_html(lxb_dom_node_t *node, bool skip_whitespace_nodes,
-                        std::string &html)
+  // An inverted index from tag names, ids, class names and attribute
+  // names to the elements that have them, in document order.
+  //
+  // The index is used to find candidate elements for simple selectors,
+  // which are then verified with the selectors engine, so the keys only
+  // need to give a superset of the actual matches. For this reason all
+  // keys are lowercased, which covers case-insensitive matching.
+  //
+  // Similarly to lxb_selectors_find, the index does not include
+  // template contents.
+  class SelectorIndex
   {
-    if (node->type == LXB_DOM_NODE_TYPE_TEXT)
+  public:
+    enum Kind
     {
-      auto character_data = lxb_dom_interface_character_data(node);
-
-      auto whitespace_size = leading_whitespace_size(character_data->data.data,
-                                                     character_data->data.length);
+      TAG,
+      ID,
+      CLASS,
+      ATTRIBUTE,
+      NUM_KINDS
+    };
+
+    struct Entry
+    {
+      size_t position;
+      lxb_dom_node_t *node;
+    };
 
-      if (whitespace_size == character_data->data.length &&
-          skip_whitespace_nodes)
-      {
-        // Append nothing
-      }
-      else
+    SelectorIndex(lxb_dom_node_t *root)
+    {
+      auto walker = TreeWalker(child_nodes_of(root), false);
+      // Elements are numbered in document order, other nodes never
+      // match selectors, so they take no position.
+      size_t position = 0;
+      // Indices of the ranges of the elements we are currently within.
+      auto open_ranges = std::vector<size_t>();
+
+      while (walker.next())
       {
-        if (is_noescape_text_node(node))
+        auto node = walker.node();
+
+        if (node->type != LXB_DOM_NODE_TYPE_ELEMENT)
         {
-          html.append(reinterpret_cast<char *>(character_data->data.data),
-                      character_data->data.length);
+          continue;
         }
-        else
+
+        if (walker.event() == TreeWalker::LEAVE)
         {
-          append_escaping(html, character_data->data.data,
-                          character_data->data.length, whitespace_size);
+          this->ranges[open_ranges.back()].end = position;
+          open_ranges.pop_back();
+          continue;
         }
+
+        this->add_node(node, position);
+        open_ranges.push_back(this->ranges.size());
+        this->ranges.push_back(Range{node, position, position + 1});
+        position++;
       }
+
+      this->ranges.shrink_to_fit();
+      std::sort(this->ranges.begin(), this->ranges.end(),
+                [](const Range &left, const Range &right)
+                { return left.node < right.node; });
+
+      this->bytes = this->measure();
     }
-    else if (node->type == LXB_DOM_NODE_TYPE_COMMENT)
+
+    // Returns the indexed elements for the given lowercased key.
+    const std::vector<Entry> &lookup(Kind kind, const std::string &key) const
     {
-      auto character_data = lxb_dom_interface_character_data(node);
-      html.append("<!--");
-      html.append(reinterpret_cast<char *>(character_data->data.data),
-                  character_data->data.length);
-      html.append("-->");
+      auto it = this->keys[kind].find(key);
+      if (it == this->keys[kind].end())
+      {
+        return this->no_entries;
+      }
+
+      return it->second;
     }
-    else if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+
+    // Returns the range of positions covered by the subtree of the
+    // given element, or nullopt if it is not an indexed element.
+    std::optional<std::pair<size_t, size_t>>
+    subtree_range(lxb_dom_node_t *node) const
     {
-      auto element = lxb_dom_interface_element(node);
-      size_t name_length;
-      auto name = lxb_dom_element_qualified_name(element, &name_length);
-      if (name == NULL)
+      auto it = std::lower_bound(
+          this->ranges.begin(), this->ranges.end(), node,
+          [](const Range &range, lxb_dom_node_t *node)
+          { return range.node < node; });
+      if (it == this->ranges.end() || it->node != node)
       {
-        throw std::runtime_error("failed to read tag name");
+        return std::nullopt;
       }
-      html.append("<");
-      html.append(reinterpret_cast<const char *>(name), name_length);
 
-      for (auto attribute = lxb_dom_element_first_attribute(element);
-           attribute != NULL;
-           attribute = lxb_dom_element_next_attribute(attribute))
+      return std::make_pair(it->first, it->end);
+    }
+
+    // Returns the approximate number of bytes allocated by the index.
+    size_t memory() const { return this->bytes; }
+
+  private:
+    struct Range
+    {
+      lxb_dom_node_t *node;
+      size_t first;
+      size_t end;
+    };
+
+    std::unordered_map<std::string, std::vector<Entry>> keys[NUM_KINDS];
+    // Sorted by node, for binary search.
+    std::vector<Range> ranges;
+    std::vector<Entry> no_entries;
+    size_t bytes = 0;
+
+    size_t measure() const
+    {
+      auto inline_capacity = std::string().capacity();
+      auto bytes = sizeof(SelectorIndex) + this->ranges.capacity() * sizeof(Range);
+
+      for (auto &map : this->keys)
       {
-        html.append(" ");
+        bytes += map.bucket_count() * sizeof(void *);
 
-        size_t name_length;
-        auto name = lxb_dom_attr_qualified_name(attribute, &name_length);
-        html.append(reinterpret_cast<const char *>(name), name_length);
+        for (auto &[key, entries] : map)
+        {
+          // Hash map nodes hold the pair, the next pointer and the
+          // cached hash.
+          bytes += sizeof(std::pair<const std::string, std::vector<Entry>>) +
+                   2 * sizeof(void *);
+          if (key.capacity() > inline_capacity)
+          {
+            bytes += key.capacity() + 1;
+          }
+          bytes += entries.capacity() * sizeof(Entry);
+        }
+      }
 
-        html.append("=\"");
+      return bytes;
+    }
 
-        size_t value_length;
-        auto value = lxb_dom_attr_value(attribute, &value_length);
-        append_escaping(html, value, value_length);
+    void add(Kind kind, const lxb_char_t *data, size_t length,
+             lxb_dom_node_t *node, size_t position)
+    {
+      auto &entries = this->keys[kind][ascii_lowercase(data, length)];
 
-        html.append("\"");
+      // An element may have the same key multiple times, for example
+      // a repeated class name.
+      if (entries.empty() || entries.back().node != node)
+      {
+        entries.push_back(Entry{position, node});
       }
+    }
 
-      if (lxb_html_node_is_void(node))
+    void add_node(lxb_dom_node_t *node, size_t position)
+    {
+      if (node->type != LXB_DOM_NODE_TYPE_ELEMENT)
       {
-        html.append("/>");
+        return;
       }
-      else
+
+      auto element = lxb_dom_interface_element(node);
+
+      size_t name_length;
+      auto name = lxb_dom_element_local_name(element, &name_length);
+      this->add(TAG, name, name_length, node, position);
+
+      for (auto attr = lxb_dom_element_first_attribute(element); attr != NULL;
+           attr = lxb_dom_element_next_attribute(attr))
       {
-        html.append(">");
-        for (auto child = template_aware_first_child(node); child != NULL;
-             child = lxb_dom_node_next(child))
+        size_t name_length;
+        auto name = lxb_dom_attr_qualified_name(attr, &name_length);
+        this->add(ATTRIBUTE, name, name_length, node, position);
+
+        size_t local_name_length;
+        auto local_name = lxb_dom_attr_local_name(attr, &local_name_length);
+        if (local_name_length != name_length)
         {
-          append_node_html(child, skip_whitespace_nodes, html);
+          this->add(ATTRIBUTE, local_name, local_name_length, node, position);
         }
-        html.append("</");
-        html.append(reinterpret_cast<const char *>(name), name_length);
-        html.append(">");
       }
-    }
-  }
 
-  std::string to_html(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
-                      bool skip_whitespace_nodes)
-  {
-    auto string = std::string();
+      if (auto id = element_id(node))
+      {
+        this->add(ID, reinterpret_cast<const lxb_char_t *>(id->data()),
+                  id->size(), node, position);
+      }
 
-    for (auto node : ex_lazy_html.resource->nodes)
-    {
-      append_node_html(node, skip_whitespace_nodes, string);
-    }
+      size_t class_length;
+      auto class_value = lxb_dom_element_get_attribute(
+          element, reinterpret_cast<const lxb_char_t *>("class"), 5,
+          &class_length);
 
-    return string;
-  }
+      if (class_value != NULL)
+      {
+        size_t offset = 0;
 
-  FINE_NIF(to_html, 0);
+        while (offset < class_length)
+        {
+          while (offset < class_length && is_class_separator(class_value[offset]))
+          {
+            offset++;
+          }
 
-  ERL_NIF_TERM attributes_to_term(ErlNifEnv *env, lxb_dom_element_t *element,
-                                  bool sort_attributes)
-  {
-    auto attributes = std::vector<std::tuple<std::string, std::string>>();
+          auto start = offset;
+
+          while (offset < class_length && !is_class_separator(class_value[offset]))
+          {
+            offset++;
+          }
+
+          if (offset > start)
+          {
+            this->add(CLASS, class_value + start, offset - start, node,
+                      position);
+          }
+        }
+      }
+    }
 
-    for (auto attribute = lxb_dom_element_first_attribute(element);
-         attribute != NULL;
-         attribute = lxb_dom_element_next_attribute(attribute))
+    static bool is_class_separator(lxb_char_t ch)
     {
-      size_t name_length;
-      auto name = lxb_dom_attr_qualified_name(attribute, &name_length);
+      return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\f' ||
+             ch == '\r';
+    }
+  };
 
-      size_t value_length;
-      auto value = lxb_dom_attr_value(attribute, &value_length);
+  // Number of indexable queries against a document after which we
+  // build the selector index. Building the index costs about as much
+  // as a few queries, so we only do it for documents that are queried
+  // repeatedly.
+  constexpr uint64_t selector_index_threshold = 4;
 
-      auto name_string =
-          std::string(reinterpret_cast<const char *>(name), name_length);
-      auto value_string =
-          std::string(reinterpret_cast<const char *>(value), value_length);
+  // Maximum bytes of HTML memoized per document, see SubtreeCache.
+  constexpr size_t subtree_cache_max_bytes = 4 * 1024 * 1024;
 
-      attributes.push_back(std::make_tuple(name_string, value_string));
+  // Attribute values up to this size are always copied, see
+  // ElementEncoder.
+  constexpr size_t copied_attribute_value_max_bytes = 64;
+
+  size_t mraw_memory(lexbor_mraw_t *mraw)
+  {
+    if (mraw == NULL || mraw->mem == NULL)
+    {
+      return 0;
     }
 
-    if (sort_attributes)
+    size_t size = 0;
+    for (auto chunk = mraw->mem->chunk_first; chunk != NULL;
+         chunk = chunk->next)
     {
-      std::sort(attributes.begin(), attributes.end(),
-                [](const auto &left, const auto &right)
-                {
-                  return std::get<0>(left) < std::get<0>(right);
-                });
+      size += chunk->size;
     }
+    return size;
+  }
 
-    return fine::encode(env, attributes);
+  // Returns the number of bytes allocated by the document arenas, which
+  // hold all of the nodes, attributes and text.
+  size_t document_memory(lxb_html_document_t *document)
+  {
+    return mraw_memory(document->dom_document.mraw) +
+           mraw_memory(document->dom_document.text);
   }
 
-  void node_to_tree(ErlNifEnv *env, fine::ResourcePtr<LazyHTML> &resource,
-                    lxb_dom_node_t *node, std::vector<ERL_NIF_TERM> &tree,
-                    bool sort_attributes, bool skip_whitespace_nodes)
+  // Counters of parsed documents that are currently referenced.
+  struct DocumentStats
   {
-    if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
-    {
-      auto element = lxb_dom_interface_element(node);
+    std::atomic<uint64_t> documents{0};
+    std::atomic<uint64_t> bytes{0};
+  };
 
-      size_t name_length;
-      auto name = lxb_dom_element_qualified_name(element, &name_length);
+  DocumentStats document_stats;
+
+  struct DocumentRef
+  {
+    lxb_html_document_t *document;
+    // The node containing all nodes parsed into the document. This is
+    // the document node itself, except for fragments, where it is the
+    // fragment parse root.
+    lxb_dom_node_t *root;
+    // Arena memory held by the document, measured once it is built.
+    size_t memory;
+
+    DocumentRef(lxb_html_document_t *document, lxb_dom_node_t *root)
+        : document(document), root(root), memory(document_memory(document))
+    {
+      document_stats.documents.fetch_add(1, std::memory_order_relaxed);
+      document_stats.bytes.fetch_add(this->memory, std::memory_order_relaxed);
+    }
+
+    ~DocumentRef()
+    {
+      document_stats.documents.fetch_sub(1, std::memory_order_relaxed);
+      document_stats.bytes.fetch_sub(this->memory, std::memory_order_relaxed);
+      document_pool.release(this->document);
+    }
+
+    // Returns all elements with the given id, in document order.
+    //
+    // The index is built on first use. Documents are not modified after
+    // parsing, so it never needs to be invalidated.
+    const std::vector<lxb_dom_node_t *> &elements_by_id(std::string_view id)
+    {
+      std::call_once(this->id_index_flag, [&]
+                     { this->build_id_index(); });
+
+      auto it = this->id_index.find(std::string(id));
+      if (it == this->id_index.end())
+      {
+        return this->no_elements;
+      }
+
+      return it->second;
+    }
+
+    // Returns the selector index, or NULL if the document has not been
+    // queried enough times to build it yet.
+    const SelectorIndex *selector_index()
+    {
+      if (this->selector_index_queries.fetch_add(1) + 1 <
+          selector_index_threshold)
+      {
+        return NULL;
+      }
+
+      std::call_once(this->selector_index_flag, [&]
+                     {
+                       this->selector_index_ptr =
+                           std::make_unique<SelectorIndex>(this->root);
+                       this->selector_index_created.store(true, std::memory_order_release); });
+
+      return this->selector_index_ptr.get();
+    }
+
+    // Returns the bytes allocated by the selector index, if built.
+    size_t selector_index_size()
+    {
+      if (!this->selector_index_created.load(std::memory_order_acquire))
+      {
+        return 0;
+      }
+
+      return this->selector_index_ptr->memory();
+    }
+
+    // Returns the cache of serialized subtrees, created on first use.
+    SubtreeCache &subtree_cache()
+    {
+      std::call_once(this->subtree_cache_flag, [&]
+                     {
+                       this->subtree_cache_ptr = std::make_unique<SubtreeCache>(
+                           subtree_cache_max_bytes);
+                       this->subtree_cache_created.store(true, std::memory_order_release); });
+
+      return *this->subtree_cache_ptr;
+    }
+
+    // Returns the bytes of HTML held by the cache of serialized
+    // subtrees, if any.
+    size_t subtree_cache_size()
+    {
+      if (!this->subtree_cache_created.load(std::memory_order_acquire))
+      {
+        return 0;
+      }
+
+      return this->subtree_cache_ptr->size();
+    }
+
+  private:
+    std::atomic<uint64_t> selector_index_queries{0};
+    std::once_flag selector_index_flag;
+    std::unique_ptr<SelectorIndex> selector_index_ptr;
+    std::atomic<bool> selector_index_created{false};
+    std::once_flag subtree_cache_flag;
+    std::unique_ptr<SubtreeCache> subtree_cache_ptr;
+    std::atomic<bool> subtree_cache_created{false};
+    std::once_flag id_index_flag;
+    std::unordered_map<std::string, std::vector<lxb_dom_node_t *>> id_index;
+    std::vector<lxb_dom_node_t *> no_elements;
+
+    void build_id_index()
+    {
+      auto walker = TreeWalker(child_nodes_of(this->root), false);
+
+      while (walker.next())
+      {
+        if (walker.event() == TreeWalker::ENTER)
+        {
+          if (auto id = element_id(walker.node()))
+          {
+            this->id_index[std::string(*id)].push_back(walker.node());
+          }
+        }
+      }
+    }
+  };
+
+  // A fixed-size pool of threads used to split work within a single
+  // NIF call.
+  //
+  // The calling thread always takes part in the work, so a call makes
+  // progress even when all workers are busy with other calls. Callers
+  // and workers share a budget of max_threads threads: a call only gets
+  // helpers for the part of the budget not already taken by other calls
+  // and their helpers. This way, when several dirty schedulers run
+  // parallel calls at once, workers do not add threads on top of them,
+  // and the calls run mostly on their callers.
+  //
+  // Worker threads are detached and the pool is never destroyed, since
+  // the library is never unloaded.
+  class WorkerPool
+  {
+  public:
+    void set_size(size_t size, size_t max_threads)
+    {
+      auto lock = std::lock_guard<std::mutex>(this->mutex);
+
+      this->size = size;
+      this->max_threads = max_threads;
+
+      for (; this->num_threads < size; this->num_threads++)
+      {
+        std::thread([this]()
+                    { this->work(); })
+            .detach();
+      }
+
+      // Wake up idle threads, so that the surplus ones exit.
+      this->condition.notify_all();
+    }
+
+    size_t get_size()
+    {
+      auto lock = std::lock_guard<std::mutex>(this->mutex);
+      return this->size;
+    }
+
+    // Calls fun(i) for every i in [0, count), spreading the calls
+    // across the calling thread and the workers. Returns once all the
+    // calls are done. fun must not throw.
+    template <typename Fun>
+    void parallel_for(size_t count, Fun fun)
+    {
+      if (count == 0)
+      {
+        return;
+      }
+
+      struct State
+      {
+        Fun fun;
+        size_t count;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable condition;
+
+        State(Fun fun, size_t count) : fun(fun), count(count) {}
+      };
+
+      // Workers may only pick up their task after we return, in which
+      // case they find no work left. The state is shared, so that it
+      // outlives this call.
+      auto state = std::make_shared<State>(fun, count);
+
+      auto run = [state]()
+      {
+        for (auto i = state->next.fetch_add(1); i < state->count;
+             i = state->next.fetch_add(1))
+        {
+          state->fun(i);
+
+          if (state->done.fetch_add(1) + 1 == state->count)
+          {
+            auto lock = std::lock_guard<std::mutex>(state->mutex);
+            state->condition.notify_all();
+          }
+        }
+      };
+
+      {
+        auto lock = std::lock_guard<std::mutex>(this->mutex);
+
+        // The caller always runs, even if it exceeds the budget, since
+        // its scheduler thread is busy with this call either way.
+        this->busy_threads++;
+
+        auto available = this->max_threads > this->busy_threads
+                             ? this->max_threads - this->busy_threads
+                             : 0;
+        auto num_helpers = std::min({count - 1, this->size, available});
+        // Released by the workers once they finish the task.
+        this->busy_threads += num_helpers;
+
+        for (size_t i = 0; i < num_helpers; i++)
+        {
+          this->tasks.push_back(run);
+        }
+
+        this->condition.notify_all();
+      }
+
+      run();
+
+      {
+        auto lock = std::unique_lock<std::mutex>(state->mutex);
+        state->condition.wait(lock, [&]()
+                              { return state->done.load() == state->count; });
+      }
+
+      auto lock = std::lock_guard<std::mutex>(this->mutex);
+      this->busy_threads--;
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::function<void()>> tasks;
+    size_t size = 0;
+    size_t max_threads = 0;
+    size_t num_threads = 0;
+    // Callers within parallel_for and helper tasks not yet finished.
+    size_t busy_threads = 0;
+
+    void work()
+    {
+      auto lock = std::unique_lock<std::mutex>(this->mutex);
+
+      while (true)
+      {
+        this->condition.wait(lock, [&]()
+                             { return !this->tasks.empty() ||
+                                      this->num_threads > this->size; });
+
+        if (this->num_threads > this->size)
+        {
+          this->num_threads--;
+          return;
+        }
+
+        auto task = std::move(this->tasks.front());
+        this->tasks.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+
+        this->busy_threads--;
+      }
+    }
+  };
+
+  auto &worker_pool = *new WorkerPool();
+
+  struct LazyHTML
+  {
+    std::shared_ptr<DocumentRef> document_ref;
+    std::vector<lxb_dom_node_t *> nodes;
+    bool from_selector;
+
+    LazyHTML(std::shared_ptr<DocumentRef> document_ref,
+             std::vector<lxb_dom_node_t *> nodes, bool from_selector)
+        : document_ref(document_ref), nodes(nodes), from_selector(from_selector)
+    {
+    }
+  };
+
+  FINE_RESOURCE(LazyHTML);
+
+  struct ExLazyHTML
+  {
+    fine::ResourcePtr<LazyHTML> resource;
+
+    ExLazyHTML() {}
+    ExLazyHTML(fine::ResourcePtr<LazyHTML> resource) : resource(resource) {}
+
+    static constexpr auto module = &atoms::ElixirLazyHTML;
+
+    static constexpr auto fields()
+    {
+      return std::make_tuple(
+          std::make_tuple(&ExLazyHTML::resource, &atoms::resource));
+    }
+  };
+
+  uint64_t memory(ErlNifEnv *env, ExLazyHTML ex_lazy_html)
+  {
+    auto &document_ref = *ex_lazy_html.resource->document_ref;
+    return document_ref.memory + document_ref.selector_index_size() +
+           document_ref.subtree_cache_size();
+  }
+
+  FINE_NIF(memory, 0);
+
+  std::tuple<uint64_t, uint64_t> memory_stats(ErlNifEnv *env)
+  {
+    return std::make_tuple(
+        document_stats.documents.load(std::memory_order_relaxed),
+        document_stats.bytes.load(std::memory_order_relaxed));
+  }
+
+  FINE_NIF(memory_stats, 0);
+
+  fine::Atom set_document_pool_size(ErlNifEnv *env, uint64_t max_size)
+  {
+    document_pool.set_max_size(max_size);
+    return atoms::ok;
+  }
+
+  FINE_NIF(set_document_pool_size, 0);
+
+  std::tuple<uint64_t, uint64_t, uint64_t> document_pool_stats(ErlNifEnv *env)
+  {
+    return document_pool.stats();
+  }
+
+  FINE_NIF(document_pool_stats, 0);
+
+  std::vector<NifStats::Totals> stats(ErlNifEnv *env)
+  {
+    return nif_stats.totals();
+  }
+
+  FINE_NIF(stats, 0);
+
+  fine::Atom reset_stats(ErlNifEnv *env)
+  {
+    nif_stats.reset();
+    return atoms::ok;
+  }
+
+  FINE_NIF(reset_stats, 0);
+
+  ERL_NIF_TERM make_new_binary(ErlNifEnv *env, size_t size,
+                               const unsigned char *data)
+  {
+    ERL_NIF_TERM term;
+    auto term_data = enif_make_new_binary(env, size, &term);
+    memcpy(term_data, data, size);
+    return term;
+  }
+
+  // An output buffer backed by a BEAM binary. It grows geometrically
+  // and once done, the binary is shrunk to the actual size and handed
+  // over to the VM, so the output is never copied.
+  class BinaryBuffer
+  {
+  public:
+    BinaryBuffer(size_t capacity = 1024)
+    {
+      if (!enif_alloc_binary(capacity, &this->binary))
+      {
+        throw std::bad_alloc();
+      }
+      this->owned = true;
+    }
+
+    BinaryBuffer(const BinaryBuffer &) = delete;
+    BinaryBuffer &operator=(const BinaryBuffer &) = delete;
+
+    BinaryBuffer(BinaryBuffer &&other)
+        : binary(other.binary), length(other.length), owned(other.owned)
+    {
+      other.owned = false;
+    }
+
+    ~BinaryBuffer()
+    {
+      if (this->owned)
+      {
+        enif_release_binary(&this->binary);
+      }
+    }
+
+    void append(const char *data, size_t size)
+    {
+      if (this->length + size > this->binary.size)
+      {
+        this->grow(this->length + size);
+      }
+
+      memcpy(this->binary.data + this->length, data, size);
+      this->length += size;
+    }
+
+    void append(const char *string) { this->append(string, strlen(string)); }
+
+    size_t size() { return this->length; }
+
+    // Returns the buffer contents as a binary term. The buffer cannot
+    // be used afterwards.
+    ERL_NIF_TERM make_term(ErlNifEnv *env)
+    {
+      if (this->length <= heap_binary_limit)
+      {
+        // Small binaries are stored on the process heap, which is
+        // cheaper than keeping a reference counted one.
+        return make_new_binary(env, this->length, this->binary.data);
+      }
+
+      if (!enif_realloc_binary(&this->binary, this->length))
+      {
+        throw std::bad_alloc();
+      }
+
+      this->owned = false;
+      return enif_make_binary(env, &this->binary);
+    }
+
+  private:
+    static constexpr size_t heap_binary_limit = 64;
+
+    ErlNifBinary binary;
+    size_t length = 0;
+    bool owned = false;
+
+    void grow(size_t min_capacity)
+    {
+      auto capacity = std::max(this->binary.size * 2, min_capacity);
+
+      if (!enif_realloc_binary(&this->binary, capacity))
+      {
+        throw std::bad_alloc();
+      }
+    }
+  };
+
+  // An output buffer made of fixed-size BEAM binaries. Complete chunks
+  // can be handed over to the VM while the output is still being
+  // written, so the full output never needs to be held in one piece.
+  class ChunkedBinaryBuffer
+  {
+  public:
+    ChunkedBinaryBuffer(size_t chunk_size) : chunk_size(chunk_size)
+    {
+      if (chunk_size == 0)
+      {
+        throw std::invalid_argument("chunk size must be positive");
+      }
+    }
+
+    ChunkedBinaryBuffer(const ChunkedBinaryBuffer &) = delete;
+    ChunkedBinaryBuffer &operator=(const ChunkedBinaryBuffer &) = delete;
+
+    ChunkedBinaryBuffer(ChunkedBinaryBuffer &&other)
+        : chunk_size(other.chunk_size), chunks(std::move(other.chunks)),
+          current(other.current), length(other.length), total(other.total),
+          owned(other.owned)
+    {
+      other.chunks.clear();
+      other.owned = false;
+    }
+
+    ~ChunkedBinaryBuffer()
+    {
+      for (auto &chunk : this->chunks)
+      {
+        enif_release_binary(&chunk);
+      }
+
+      if (this->owned)
+      {
+        enif_release_binary(&this->current);
+      }
+    }
+
+    void append(const char *data, size_t size)
+    {
+      this->total += size;
+
+      while (size > 0)
+      {
+        if (!this->owned)
+        {
+          if (!enif_alloc_binary(this->chunk_size, &this->current))
+          {
+            throw std::bad_alloc();
+          }
+          this->owned = true;
+          this->length = 0;
+        }
+
+        auto count = std::min(size, this->chunk_size - this->length);
+        memcpy(this->current.data + this->length, data, count);
+        this->length += count;
+        data += count;
+        size -= count;
+
+        if (this->length == this->chunk_size)
+        {
+          this->chunks.push_back(this->current);
+          this->owned = false;
+        }
+      }
+    }
+
+    void append(const char *string) { this->append(string, strlen(string)); }
+
+    // The total number of bytes written.
+    size_t size() { return this->total; }
+
+    size_t complete_chunks() { return this->chunks.size(); }
+
+    // Returns a list with the complete chunks, which are removed from
+    // the buffer.
+    ERL_NIF_TERM take_chunks(ErlNifEnv *env)
+    {
+      auto terms = std::vector<ERL_NIF_TERM>();
+      terms.reserve(this->chunks.size());
+
+      for (auto &chunk : this->chunks)
+      {
+        terms.push_back(enif_make_binary(env, &chunk));
+      }
+      this->chunks.clear();
+
+      return enif_make_list_from_array(env, terms.data(),
+                                       static_cast<unsigned>(terms.size()));
+    }
+
+    // Returns a list with all the remaining chunks, the last one
+    // possibly shorter. The buffer cannot be used afterwards.
+    ERL_NIF_TERM make_term(ErlNifEnv *env)
+    {
+      if (this->owned)
+      {
+        if (!enif_realloc_binary(&this->current, this->length))
+        {
+          throw std::bad_alloc();
+        }
+        this->chunks.push_back(this->current);
+        this->owned = false;
+      }
+
+      return this->take_chunks(env);
+    }
+
+  private:
+    size_t chunk_size;
+    std::vector<ErlNifBinary> chunks;
+    ErlNifBinary current{};
+    size_t length = 0;
+    size_t total = 0;
+    bool owned = false;
+  };
+
+  // Parses a complete document. Returns the document reference and the
+  // top-level nodes. This does not interact with the VM, so it can be
+  // called from any thread.
+  std::tuple<std::shared_ptr<DocumentRef>, std::vector<lxb_dom_node_t *>>
+  parse_document(ErlNifBinary html)
+  {
+    auto document = document_pool.acquire();
+    auto document_guard =
+        ScopeGuard([&]()
+                   { lxb_html_document_destroy(document); });
+
+    auto status = lxb_html_document_parse(document, html.data, html.size);
+    if (status != LXB_STATUS_OK)
+    {
+      throw std::runtime_error("failed to parse html document");
+    }
+
+    auto document_ref = std::make_shared<DocumentRef>(
+        document, lxb_dom_interface_node(document));
+    document_guard.deactivate();
+
+    auto nodes = std::vector<lxb_dom_node_t *>();
+    for (auto node = lxb_dom_node_first_child(lxb_dom_interface_node(document));
+         node != NULL; node = lxb_dom_node_next(node))
+    {
+      nodes.push_back(node);
+    }
+
+    return std::make_tuple(document_ref, nodes);
+  }
+
+  ExLazyHTML from_document(ErlNifEnv *env, ErlNifBinary html)
+  {
+    auto call = NifCall(NifId::FROM_DOCUMENT);
+    call.add_bytes_in(html.size);
+
+    auto [document_ref, nodes] = parse_document(html);
+    return ExLazyHTML(fine::make_resource<LazyHTML>(document_ref, nodes, false));
+  }
+
+  FINE_NIF(from_document, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  std::vector<fine::Term> from_documents(ErlNifEnv *env,
+                                         std::vector<ErlNifBinary> htmls,
+                                         bool parallel)
+  {
+    auto call = NifCall(NifId::FROM_DOCUMENTS);
+    for (auto &html : htmls)
+    {
+      call.add_bytes_in(html.size);
+    }
+
+    using Result =
+        std::variant<std::tuple<std::shared_ptr<DocumentRef>,
+                                std::vector<lxb_dom_node_t *>>,
+                     std::string>;
+
+    auto results = std::vector<Result>(htmls.size());
+
+    auto parse = [&](size_t i)
+    {
+      try
+      {
+        results[i] = parse_document(htmls[i]);
+      }
+      catch (const std::exception &error)
+      {
+        results[i] = std::string(error.what());
+      }
+    };
+
+    if (parallel)
+    {
+      worker_pool.parallel_for(htmls.size(), parse);
+    }
+    else
+    {
+      for (size_t i = 0; i < htmls.size(); i++)
+      {
+        parse(i);
+      }
+    }
+
+    auto terms = std::vector<fine::Term>();
+
+    for (auto &result : results)
+    {
+      if (auto error = std::get_if<std::string>(&result))
+      {
+        terms.push_back(enif_make_tuple2(env, fine::encode(env, atoms::error),
+                                         fine::encode(env, *error)));
+      }
+      else
+      {
+        auto &[document_ref, nodes] = std::get<0>(result);
+        auto ex_lazy_html = ExLazyHTML(
+            fine::make_resource<LazyHTML>(document_ref, nodes, false));
+        terms.push_back(enif_make_tuple2(env, fine::encode(env, atoms::ok),
+                                         fine::encode(env, ex_lazy_html)));
+      }
+    }
+
+    return terms;
+  }
+
+  FINE_NIF(from_documents, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  fine::Atom set_worker_pool_size(ErlNifEnv *env, uint64_t size,
+                                  uint64_t max_threads)
+  {
+    worker_pool.set_size(size, max_threads);
+    return atoms::ok;
+  }
+
+  FINE_NIF(set_worker_pool_size, 0);
+
+  ExLazyHTML from_fragment(ErlNifEnv *env, ErlNifBinary html)
+  {
+    auto call = NifCall(NifId::FROM_FRAGMENT);
+    call.add_bytes_in(html.size);
+
+    auto document = document_pool.acquire();
+    auto document_guard =
+        ScopeGuard([&]()
+                   { lxb_html_document_destroy(document); });
+
+    auto context = lxb_dom_document_create_element(
+        &document->dom_document, reinterpret_cast<const lxb_char_t *>("body"), 4,
+        NULL);
+
+    auto parse_root =
+        lxb_html_document_parse_fragment(document, context, html.data, html.size);
+    if (parse_root == NULL)
+    {
+      throw std::runtime_error("failed to parse html fragment");
+    }
+
+    auto document_ref = std::make_shared<DocumentRef>(document, parse_root);
+    document_guard.deactivate();
+
+    auto nodes = std::vector<lxb_dom_node_t *>();
+    for (auto node = lxb_dom_node_first_child(parse_root); node != NULL;
+         node = lxb_dom_node_next(node))
+    {
+      nodes.push_back(node);
+    }
+
+    return ExLazyHTML(fine::make_resource<LazyHTML>(document_ref, nodes, false));
+  }
+
+  FINE_NIF(from_fragment, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  // A document being parsed incrementally, as chunks of the input
+  // arrive. The session is mutable, so concurrent calls are serialized
+  // with the mutex.
+  struct ParserSession
+  {
+    std::mutex mutex;
+    lxb_html_document_t *document;
+
+    ParserSession(lxb_html_document_t *document) : document(document) {}
+
+    ~ParserSession()
+    {
+      if (this->document != NULL)
+      {
+        // The parser may be in the middle of the input, so we do not
+        // recycle the document.
+        lxb_html_document_destroy(this->document);
+      }
+    }
+  };
+
+  FINE_RESOURCE(ParserSession);
+
+  struct ExParser
+  {
+    fine::ResourcePtr<ParserSession> resource;
+
+    ExParser() {}
+    ExParser(fine::ResourcePtr<ParserSession> resource) : resource(resource) {}
+
+    static constexpr auto module = &atoms::ElixirLazyHTMLParser;
+
+    static constexpr auto fields()
+    {
+      return std::make_tuple(
+          std::make_tuple(&ExParser::resource, &atoms::resource));
+    }
+  };
+
+  ExParser parser_new(ErlNifEnv *env)
+  {
+    auto document = document_pool.acquire();
+    auto document_guard =
+        ScopeGuard([&]()
+                   { lxb_html_document_destroy(document); });
+
+    auto status = lxb_html_document_parse_chunk_begin(document);
+    if (status != LXB_STATUS_OK)
+    {
+      throw std::runtime_error("failed to start html document parsing");
+    }
+
+    auto resource = fine::make_resource<ParserSession>(document);
+    document_guard.deactivate();
+
+    return ExParser(resource);
+  }
+
+  FINE_NIF(parser_new, 0);
+
+  fine::Atom parser_feed(ErlNifEnv *env, ExParser ex_parser, ErlNifBinary html)
+  {
+    auto call = NifCall(NifId::PARSER_FEED);
+    call.add_bytes_in(html.size);
+
+    auto &session = *ex_parser.resource;
+    auto lock = std::lock_guard<std::mutex>(session.mutex);
+
+    if (session.document == NULL)
+    {
+      throw std::invalid_argument("parser has already finished");
+    }
+
+    // lexbor copies any incomplete token at the end of the chunk into
+    // its own buffer, so the chunk does not need to outlive this call.
+    auto status =
+        lxb_html_document_parse_chunk(session.document, html.data, html.size);
+    if (status != LXB_STATUS_OK)
+    {
+      lxb_html_document_destroy(session.document);
+      session.document = NULL;
+      throw std::runtime_error("failed to parse html document");
+    }
+
+    return atoms::ok;
+  }
+
+  FINE_NIF(parser_feed, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  ExLazyHTML parser_finish(ErlNifEnv *env, ExParser ex_parser)
+  {
+    auto call = NifCall(NifId::PARSER_FINISH);
+
+    auto &session = *ex_parser.resource;
+    auto lock = std::lock_guard<std::mutex>(session.mutex);
+
+    if (session.document == NULL)
+    {
+      throw std::invalid_argument("parser has already finished");
+    }
+
+    auto document = session.document;
+    session.document = NULL;
+    auto document_guard =
+        ScopeGuard([&]()
+                   { lxb_html_document_destroy(document); });
+
+    auto status = lxb_html_document_parse_chunk_end(document);
+    if (status != LXB_STATUS_OK)
+    {
+      throw std::runtime_error("failed to parse html document");
+    }
+
+    auto document_ref = std::make_shared<DocumentRef>(
+        document, lxb_dom_interface_node(document));
+    document_guard.deactivate();
+
+    auto nodes = std::vector<lxb_dom_node_t *>();
+    for (auto node = lxb_dom_node_first_child(lxb_dom_interface_node(document));
+         node != NULL; node = lxb_dom_node_next(node))
+    {
+      nodes.push_back(node);
+    }
+
+    return ExLazyHTML(fine::make_resource<LazyHTML>(document_ref, nodes, false));
+  }
+
+  FINE_NIF(parser_finish, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  // The functions below expose the serializer kernels, so that tests
+  // can compare the vectorized implementations against scalar ones.
+
+  std::string debug_escape(ErlNifEnv *env, ErlNifBinary data, bool scalar)
+  {
+    auto kernels = scalar ? simd::scalar_kernels() : simd::kernels;
+    auto html = std::string();
+    append_escaping(html, data.data, data.size, 0, kernels);
+    return html;
+  }
+
+  FINE_NIF(debug_escape, 0);
+
+  uint64_t debug_leading_whitespace_size(ErlNifEnv *env, ErlNifBinary data,
+                                         bool scalar)
+  {
+    auto kernels = scalar ? simd::scalar_kernels() : simd::kernels;
+    return leading_whitespace_size(data.data, data.size, kernels);
+  }
+
+  FINE_NIF(debug_leading_whitespace_size, 0);
+
+  // NIFs that walk potentially large documents do the work in batches
+  // and in between they report the elapsed time to the scheduler. Once
+  // the timeslice is used up, they save the traversal state and
+  // reschedule themselves with enif_schedule_nif, so that they do not
+  // block the scheduler for longer than expected.
+  constexpr size_t nodes_per_timeslice_check = 256;
+
+  class Timeslice
+  {
+  public:
+    Timeslice(ErlNifEnv *env)
+        : env(env), last_report(enif_monotonic_time(ERL_NIF_USEC)) {}
+
+    // Reports the time elapsed since the last report and returns true
+    // if the process should yield.
+    bool exhausted()
+    {
+      auto now = enif_monotonic_time(ERL_NIF_USEC);
+      // A timeslice is roughly 1ms.
+      auto percent = (now - this->last_report) / 10;
+
+      if (percent < 1)
+      {
+        return false;
+      }
+
+      this->last_report = now;
+
+      return enif_consume_timeslice(
+          this->env, static_cast<int>(std::min<ErlNifTime>(percent, 100)));
+    }
+
+  private:
+    ErlNifEnv *env;
+    ErlNifTime last_report;
+  };
+
+  // Raises RuntimeError from NIFs that are not defined with FINE_NIF,
+  // such as the ones scheduled with enif_schedule_nif.
+  ERL_NIF_TERM raise_runtime_error(ErlNifEnv *env, const char *message)
+  {
+    ERL_NIF_TERM keys[] = {
+        enif_make_atom(env, "__struct__"),
+        enif_make_atom(env, "__exception__"),
+        enif_make_atom(env, "message"),
+    };
+    ERL_NIF_TERM values[] = {
+        enif_make_atom(env, "Elixir.RuntimeError"),
+        enif_make_atom(env, "true"),
+        make_new_binary(env, strlen(message),
+                        reinterpret_cast<const unsigned char *>(message)),
+    };
+
+    ERL_NIF_TERM exception;
+    enif_make_map_from_arrays(env, keys, values, 3, &exception);
+
+    return enif_raise_exception(env, exception);
+  }
+
+  template <typename Buffer>
+  struct HtmlSerializerTask
+  {
+    // Keeps the document alive while the task is suspended.
+    fine::ResourcePtr<LazyHTML> resource;
+    HtmlSerializer<Buffer> serializer;
+
+    HtmlSerializerTask(fine::ResourcePtr<LazyHTML> resource,
+                       HtmlSerializer<Buffer> serializer)
+        : resource(resource), serializer(std::move(serializer)) {}
+  };
+
+  FINE_RESOURCE(HtmlSerializerTask<BinaryBuffer>);
+  FINE_RESOURCE(HtmlSerializerTask<ChunkedBinaryBuffer>);
+
+  template <typename Buffer>
+  ERL_NIF_TERM to_html_continue(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+  // Runs the serializer until it is done or the timeslice is used up.
+  // Returns the serialized HTML or a reschedule term.
+  template <typename Buffer, typename GetTask>
+  ERL_NIF_TERM run_html_serializer(ErlNifEnv *env, NifCall &call,
+                                   HtmlSerializer<Buffer> &serializer,
+                                   GetTask get_task)
+  {
+    auto timeslice = Timeslice(env);
+
+    while (!serializer.run(nodes_per_timeslice_check))
+    {
+      if (timeslice.exhausted())
+      {
+        ERL_NIF_TERM args[] = {fine::encode(env, get_task())};
+        return enif_schedule_nif(env, "to_html_continue", 0,
+                                 to_html_continue<Buffer>, 1, args);
+      }
+    }
+
+    timeslice.exhausted();
+
+    call.add_nodes(serializer.nodes_visited());
+    call.add_bytes_out(serializer.html.size());
+
+    return serializer.html.make_term(env);
+  }
+
+  template <typename Buffer>
+  ERL_NIF_TERM to_html_continue(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[])
+  {
+    try
+    {
+      auto call = NifCall(NifId::TO_HTML, false);
+      auto task = fine::decode<fine::ResourcePtr<HtmlSerializerTask<Buffer>>>(
+          env, argv[0]);
+      return run_html_serializer(env, call, task->serializer, [&]()
+                                 { return task; });
+    }
+    catch (const std::exception &error)
+    {
+      return raise_runtime_error(env, error.what());
+    }
+  }
+
+  template <typename Buffer>
+  ERL_NIF_TERM serialize_html(ErlNifEnv *env, NifCall &call,
+                              ExLazyHTML &ex_lazy_html,
+                              HtmlSerializer<Buffer> serializer)
+  {
+    // Most calls finish within a single timeslice, so we only move the
+    // serializer into a resource once we actually need to yield.
+    return run_html_serializer(env, call, serializer, [&]()
+                               { return fine::make_resource<HtmlSerializerTask<Buffer>>(
+                                     ex_lazy_html.resource, std::move(serializer)); });
+  }
+
+  fine::Term to_html(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                     bool skip_whitespace_nodes,
+                     std::optional<uint64_t> chunk_size, bool memoize)
+  {
+    auto call = NifCall(NifId::TO_HTML);
+    auto &nodes = ex_lazy_html.resource->nodes;
+    auto cache = memoize ? &ex_lazy_html.resource->document_ref->subtree_cache()
+                         : NULL;
+
+    if (chunk_size)
+    {
+      auto serializer = HtmlSerializer<ChunkedBinaryBuffer>(
+          nodes, skip_whitespace_nodes, ChunkedBinaryBuffer(*chunk_size));
+      // Chunks are emitted as soon as they are complete, so we only
+      // reuse cached HTML, see HtmlSerializer::set_cache.
+      serializer.set_cache(cache, false);
+      return serialize_html(env, call, ex_lazy_html, std::move(serializer));
+    }
+
+    auto serializer = HtmlSerializer<BinaryBuffer>(nodes, skip_whitespace_nodes);
+    serializer.set_cache(cache);
+    return serialize_html(env, call, ex_lazy_html, std::move(serializer));
+  }
+
+  FINE_NIF(to_html, 0);
+
+  // Serialization of a document resumed on every call, producing the
+  // output one chunk at a time. The stream is mutable, so concurrent
+  // calls are serialized with the mutex.
+  struct HtmlStream
+  {
+    std::mutex mutex;
+    // Keeps the document alive while the stream is in use.
+    fine::ResourcePtr<LazyHTML> resource;
+    HtmlSerializer<ChunkedBinaryBuffer> serializer;
+    bool done = false;
+
+    HtmlStream(fine::ResourcePtr<LazyHTML> resource,
+               HtmlSerializer<ChunkedBinaryBuffer> serializer)
+        : resource(resource), serializer(std::move(serializer)) {}
+  };
+
+  FINE_RESOURCE(HtmlStream);
+
+  fine::ResourcePtr<HtmlStream> to_html_stream_new(ErlNifEnv *env,
+                                                   ExLazyHTML ex_lazy_html,
+                                                   bool skip_whitespace_nodes,
+                                                   uint64_t chunk_size,
+                                                   bool memoize)
+  {
+    auto call = NifCall(NifId::TO_HTML_STREAM);
+
+    auto serializer = HtmlSerializer<ChunkedBinaryBuffer>(
+        ex_lazy_html.resource->nodes, skip_whitespace_nodes,
+        ChunkedBinaryBuffer(chunk_size));
+    if (memoize)
+    {
+      // The stream holds the resource, which keeps the cache alive.
+      // As with chunked to_html, we only reuse cached HTML.
+      serializer.set_cache(
+          &ex_lazy_html.resource->document_ref->subtree_cache(), false);
+    }
+
+    return fine::make_resource<HtmlStream>(ex_lazy_html.resource,
+                                           std::move(serializer));
+  }
+
+  FINE_NIF(to_html_stream_new, 0);
+
+  // Serializes until at least one chunk is complete. Returns {:cont,
+  // chunks}, or {:done, chunks} with the remaining output once the
+  // serialization is finished. The list of chunks may be empty when
+  // the timeslice is used up first, in which case the caller should
+  // call again.
+  std::tuple<fine::Atom, fine::Term> to_html_stream_next(
+      ErlNifEnv *env, fine::ResourcePtr<HtmlStream> stream)
+  {
+    auto call = NifCall(NifId::TO_HTML_STREAM, false);
+
+    auto lock = std::lock_guard<std::mutex>(stream->mutex);
+    auto &serializer = stream->serializer;
+
+    if (stream->done)
+    {
+      throw std::invalid_argument("stream has already finished");
+    }
+
+    auto timeslice = Timeslice(env);
+    auto nodes_before = serializer.nodes_visited();
+    auto bytes_before = serializer.html.size();
+
+    while (serializer.html.complete_chunks() == 0)
+    {
+      if (serializer.run(nodes_per_timeslice_check))
+      {
+        stream->done = true;
+        break;
+      }
+
+      if (timeslice.exhausted())
+      {
+        break;
+      }
+    }
+
+    timeslice.exhausted();
+
+    call.add_nodes(serializer.nodes_visited() - nodes_before);
+    call.add_bytes_out(serializer.html.size() - bytes_before);
+
+    if (stream->done)
+    {
+      return std::make_tuple(atoms::done, serializer.html.make_term(env));
+    }
+
+    return std::make_tuple(atoms::cont, serializer.html.take_chunks(env));
+  }
+
+  FINE_NIF(to_html_stream_next, 0);
+
+  // Builds terms for element names and attributes.
+  //
+  // Tag and attribute names repeat a lot, so we allocate each distinct
+  // name once per NIF call and reuse the term. Names are looked up by
+  // the pointer lexbor returns, which is unique per name, since known
+  // names live in static tables and other ones in the document hash.
+  // When share_values is true, large attribute values are not copied,
+  // instead we return binaries that point directly into the document
+  // memory and keep the resource alive, same as text nodes. Such a
+  // binary retains the whole document, so we only do it for to_tree,
+  // which returns the whole content anyway. Small values are cheaper to
+  // copy than to reference, so they are always copied.
+  //
+  // Terms are only valid within the NIF call that created them, so the
+  // encoder needs to be reset whenever a new call continues the work.
+  class ElementEncoder
+  {
+  public:
+    ElementEncoder(fine::ResourcePtr<LazyHTML> resource,
+                   bool share_values = false)
+        : resource(resource), share_values(share_values) {}
+
+    ERL_NIF_TERM name(ErlNifEnv *env, lxb_dom_element_t *element)
+    {
+      size_t name_length;
+      auto name = lxb_dom_element_qualified_name(element, &name_length);
+      if (name == NULL)
+      {
+        throw std::runtime_error("failed to read tag name");
+      }
+
+      return this->intern(env, name, name_length);
+    }
+
+    ERL_NIF_TERM attributes(ErlNifEnv *env, lxb_dom_element_t *element,
+                            bool sort_attributes)
+    {
+      this->attrs.clear();
+
+      for (auto attribute = lxb_dom_element_first_attribute(element);
+           attribute != NULL;
+           attribute = lxb_dom_element_next_attribute(attribute))
+      {
+        auto attr = Attribute();
+        attr.name = lxb_dom_attr_qualified_name(attribute, &attr.name_length);
+        attr.value = lxb_dom_attr_value(attribute, &attr.value_length);
+        this->attrs.push_back(attr);
+      }
+
+      if (sort_attributes)
+      {
+        std::sort(this->attrs.begin(), this->attrs.end(),
+                  [](const Attribute &left, const Attribute &right)
+                  {
+                    auto size = std::min(left.name_length, right.name_length);
+                    auto result = memcmp(left.name, right.name, size);
+                    return result < 0 ||
+                           (result == 0 && left.name_length < right.name_length);
+                  });
+      }
+
+      this->terms.clear();
+
+      for (auto &attr : this->attrs)
+      {
+        auto name_term = this->intern(env, attr.name, attr.name_length);
+        auto value_term =
+            this->share_values &&
+                    attr.value_length > copied_attribute_value_max_bytes
+                ? fine::make_resource_binary(
+                      env, this->resource,
+                      reinterpret_cast<const char *>(attr.value),
+                      attr.value_length)
+                : make_new_binary(env, attr.value_length, attr.value);
+        this->terms.push_back(enif_make_tuple2(env, name_term, value_term));
+      }
+
+      return enif_make_list_from_array(
+          env, this->terms.data(), static_cast<unsigned int>(this->terms.size()));
+    }
+
+    void reset() { this->names.clear(); }
+
+  private:
+    struct Attribute
+    {
+      const lxb_char_t *name;
+      size_t name_length;
+      const lxb_char_t *value;
+      size_t value_length;
+    };
+
+    fine::ResourcePtr<LazyHTML> resource;
+    bool share_values;
+    std::unordered_map<const lxb_char_t *, ERL_NIF_TERM> names;
+    // Reused across elements to avoid allocations.
+    std::vector<Attribute> attrs;
+    std::vector<ERL_NIF_TERM> terms;
+
+    ERL_NIF_TERM intern(ErlNifEnv *env, const lxb_char_t *name, size_t length)
+    {
+      auto it = this->names.find(name);
+      if (it != this->names.end())
+      {
+        return it->second;
+      }
+
+      auto term = make_new_binary(env, length, name);
+      this->names.emplace(name, term);
+      return term;
+    }
+  };
+
+  // Builds the tree term for the given subtrees. The children of every
+  // open element are accumulated as reversed lists, which are reversed
+  // once the element is left.
+  class TreeBuilder
+  {
+  public:
+    TreeBuilder(fine::ResourcePtr<LazyHTML> resource, bool sort_attributes,
+                bool skip_whitespace_nodes)
+        : resource(resource), walker(resource->nodes), encoder(resource, true),
+          sort_attributes(sort_attributes),
+          skip_whitespace_nodes(skip_whitespace_nodes) {}
+
+    void init(ErlNifEnv *env)
+    {
+      auto nil = enif_make_list(env, 0);
+      this->frames.push_back(Frame{nil, nil, nil});
+    }
+
+    // Builds up to max_nodes nodes. Returns true once done.
+    bool run(ErlNifEnv *env, size_t max_nodes)
+    {
+      for (size_t i = 0; i < max_nodes; i++)
+      {
+        if (!this->walker.next())
+        {
+          return true;
+        }
+
+        auto node = this->walker.node();
+
+        if (this->walker.event() == TreeWalker::LEAVE)
+        {
+          auto frame = this->frames.back();
+          this->frames.pop_back();
+
+          ERL_NIF_TERM children;
+          enif_make_reverse_list(env, frame.children, &children);
+
+          this->push(env, enif_make_tuple3(env, frame.name, frame.attrs, children));
+        }
+        else if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+        {
+          auto element = lxb_dom_interface_element(node);
+
+          auto name_term = this->encoder.name(env, element);
+          auto attrs_term =
+              this->encoder.attributes(env, element, this->sort_attributes);
+
+          this->frames.push_back(
+              Frame{name_term, attrs_term, enif_make_list(env, 0)});
+        }
+        else if (node->type == LXB_DOM_NODE_TYPE_TEXT)
+        {
+          auto character_data = lxb_dom_interface_character_data(node);
+
+          auto whitespace_size = leading_whitespace_size(
+              character_data->data.data, character_data->data.length);
+
+          if (whitespace_size == character_data->data.length &&
+              this->skip_whitespace_nodes)
+          {
+            // Append nothing
+          }
+          else
+          {
+            auto term = fine::make_resource_binary(
+                env, this->resource,
+                reinterpret_cast<char *>(character_data->data.data),
+                character_data->data.length);
+            this->push(env, term);
+          }
+        }
+        else if (node->type == LXB_DOM_NODE_TYPE_COMMENT)
+        {
+          auto character_data = lxb_dom_interface_character_data(node);
+          auto term = fine::make_resource_binary(
+              env, this->resource,
+              reinterpret_cast<char *>(character_data->data.data),
+              character_data->data.length);
+          this->push(env,
+                     enif_make_tuple2(env, fine::encode(env, atoms::comment), term));
+        }
+      }
+
+      return false;
+    }
+
+    ERL_NIF_TERM result(ErlNifEnv *env)
+    {
+      ERL_NIF_TERM tree;
+      enif_make_reverse_list(env, this->frames.front().children, &tree);
+      return tree;
+    }
+
+    size_t nodes_visited() { return this->walker.visited(); }
+
+    // Terms do not outlive the NIF call, so before yielding we pack the
+    // partially built terms into a single term, which is passed to the
+    // next call.
+    ERL_NIF_TERM save(ErlNifEnv *env)
+    {
+      auto terms = std::vector<ERL_NIF_TERM>();
+
+      for (auto &frame : this->frames)
+      {
+        terms.push_back(
+            enif_make_tuple3(env, frame.name, frame.attrs, frame.children));
+      }
+
+      this->frames.clear();
+
+      return enif_make_list_from_array(env, terms.data(),
+                                       static_cast<unsigned int>(terms.size()));
+    }
+
+    void restore(ErlNifEnv *env, ERL_NIF_TERM saved)
+    {
+      this->encoder.reset();
+
+      ERL_NIF_TERM head, tail = saved;
+
+      while (enif_get_list_cell(env, tail, &head, &tail))
+      {
+        int arity;
+        const ERL_NIF_TERM *elements;
+        if (!enif_get_tuple(env, head, &arity, &elements) || arity != 3)
+        {
+          throw std::runtime_error("failed to restore tree state");
+        }
+
+        this->frames.push_back(Frame{elements[0], elements[1], elements[2]});
+      }
+    }
+
+  private:
+    struct Frame
+    {
+      ERL_NIF_TERM name;
+      ERL_NIF_TERM attrs;
+      // Reversed
+      ERL_NIF_TERM children;
+    };
+
+    fine::ResourcePtr<LazyHTML> resource;
+    TreeWalker walker;
+    ElementEncoder encoder;
+    bool sort_attributes;
+    bool skip_whitespace_nodes;
+    // The first frame holds the root nodes, then there is one frame for
+    // every open element.
+    std::vector<Frame> frames;
+
+    void push(ErlNifEnv *env, ERL_NIF_TERM term)
+    {
+      auto &frame = this->frames.back();
+      frame.children = enif_make_list_cell(env, term, frame.children);
+    }
+  };
+
+  FINE_RESOURCE(TreeBuilder);
+
+  ERL_NIF_TERM to_tree_continue(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[]);
+
+  template <typename GetTask>
+  ERL_NIF_TERM run_tree_builder(ErlNifEnv *env, NifCall &call,
+                                TreeBuilder &builder, GetTask get_task)
+  {
+    auto timeslice = Timeslice(env);
+
+    while (!builder.run(env, nodes_per_timeslice_check))
+    {
+      if (timeslice.exhausted())
+      {
+        // The builder may be moved into the task, so we save it first.
+        auto saved = builder.save(env);
+        ERL_NIF_TERM args[] = {fine::encode(env, get_task()), saved};
+        return enif_schedule_nif(env, "to_tree_continue", 0, to_tree_continue,
+                                 2, args);
+      }
+    }
+
+    timeslice.exhausted();
+
+    call.add_nodes(builder.nodes_visited());
+
+    return builder.result(env);
+  }
+
+  ERL_NIF_TERM to_tree_continue(ErlNifEnv *env, int argc,
+                                const ERL_NIF_TERM argv[])
+  {
+    try
+    {
+      auto call = NifCall(NifId::TO_TREE, false);
+      auto task = fine::decode<fine::ResourcePtr<TreeBuilder>>(env, argv[0]);
+      task->restore(env, argv[1]);
+      return run_tree_builder(env, call, *task, [&]()
+                              { return task; });
+    }
+    catch (const std::exception &error)
+    {
+      return raise_runtime_error(env, error.what());
+    }
+  }
+
+  fine::Term to_tree(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                     bool sort_attributes, bool skip_whitespace_nodes)
+  {
+    auto call = NifCall(NifId::TO_TREE);
+    auto builder = TreeBuilder(ex_lazy_html.resource, sort_attributes,
+                               skip_whitespace_nodes);
+    builder.init(env);
+
+    return run_tree_builder(env, call, builder, [&]()
+                            { return fine::make_resource<TreeBuilder>(
+                                  std::move(builder)); });
+  }
+
+  FINE_NIF(to_tree, 0);
+
+  std::optional<uintptr_t> get_tag_namespace(ErlNifBinary name)
+  {
+    if (strncmp("svg", reinterpret_cast<char *>(name.data), name.size) == 0)
+    {
+      // For SVG we explicitly set the namespace, similar to
+      // `document.createElementNS`. It is important because attribute
+      // names are lowercased for HTML elements, but should not be
+      // lowercased inside SVG.
+      return LXB_NS_SVG;
+    }
+
+    return std::nullopt;
+  }
+
+  // Returns the node that holds the children of the given node, which
+  // for <template> elements is their content fragment.
+  lxb_dom_node_t *template_aware_children_parent(lxb_dom_node_t *node)
+  {
+    if (lxb_html_tree_node_is(node, LXB_TAG_TEMPLATE))
+    {
+      return &lxb_html_interface_template(node)->content->node;
+    }
+
+    return node;
+  }
+
+  ErlNifBinary decode_tree_binary(ErlNifEnv *env, ERL_NIF_TERM term,
+                                 const char *what)
+  {
+    ErlNifBinary binary;
+    if (!enif_inspect_binary(env, term, &binary))
+    {
+      throw std::invalid_argument(std::string("expected ") + what +
+                                  " to be a binary");
+    }
+    return binary;
+  }
+
+  lxb_dom_node_t *element_from_tree_item(ErlNifEnv *env,
+                                         lxb_html_document_t *document,
+                                         ERL_NIF_TERM name_term,
+                                         ERL_NIF_TERM attributes_term,
+                                         std::optional<uintptr_t> &ns)
+  {
+    auto name = decode_tree_binary(env, name_term, "tag name");
+
+    auto element = lxb_dom_document_create_element(&document->dom_document,
+                                                   name.data, name.size, NULL);
+    if (element == NULL)
+    {
+      throw std::runtime_error("failed to create element");
+    }
+
+    auto node = lxb_dom_interface_node(element);
+
+    if (!ns)
+    {
+      ns = get_tag_namespace(name);
+    }
+
+    if (ns)
+    {
+      node->ns = ns.value();
+    }
+
+    ERL_NIF_TERM attribute_term;
+    while (enif_get_list_cell(env, attributes_term, &attribute_term,
+                              &attributes_term))
+    {
+      int arity;
+      const ERL_NIF_TERM *items;
+      if (!enif_get_tuple(env, attribute_term, &arity, &items) || arity != 2)
+      {
+        throw std::invalid_argument(
+            "expected attributes to be {name, value} tuples");
+      }
+
+      auto key = decode_tree_binary(env, items[0], "attribute name");
+      auto value = decode_tree_binary(env, items[1], "attribute value");
+
+      auto attr = lxb_dom_element_set_attribute(element, key.data, key.size,
+                                                value.data, value.size);
+      if (attr == NULL)
+      {
+        throw std::runtime_error("failed to set element attribute");
+      }
+    }
+
+    if (!enif_is_empty_list(env, attributes_term))
+    {
+      throw std::invalid_argument("expected attributes to be a list");
+    }
+
+    return node;
+  }
+
+  // Builds nodes from the given tree and appends them to root. We walk
+  // the terms directly, without decoding them into intermediate vectors,
+  // and keep the remaining siblings on an explicit stack, so that deep
+  // trees cannot overflow the native stack.
+  std::vector<lxb_dom_node_t *> nodes_from_tree(ErlNifEnv *env,
+                                                lxb_html_document_t *document,
+                                                lxb_dom_node_t *root,
+                                                ERL_NIF_TERM tree)
+  {
+    struct Frame
+    {
+      // The list of nodes still to be inserted into parent.
+      ERL_NIF_TERM items;
+      lxb_dom_node_t *parent;
+      std::optional<uintptr_t> ns;
+    };
+
+    auto comment_atom = fine::encode(env, atoms::comment);
+
+    auto nodes = std::vector<lxb_dom_node_t *>();
+    auto stack = std::vector<Frame>();
+    stack.push_back(Frame{tree, root, std::nullopt});
+
+    while (!stack.empty())
+    {
+      auto &frame = stack.back();
+
+      ERL_NIF_TERM item;
+      if (!enif_get_list_cell(env, frame.items, &item, &frame.items))
+      {
+        if (!enif_is_empty_list(env, frame.items))
+        {
+          throw std::invalid_argument("expected children to be a list");
+        }
+
+        stack.pop_back();
+        continue;
+      }
+
+      auto parent = frame.parent;
+      auto ns = frame.ns;
+      auto is_root = stack.size() == 1;
+
+      lxb_dom_node_t *node = NULL;
+      std::optional<ERL_NIF_TERM> children;
+
+      ErlNifBinary text;
+      int arity;
+      const ERL_NIF_TERM *items;
+
+      if (enif_inspect_binary(env, item, &text))
+      {
+        node = lxb_dom_interface_node(lxb_dom_document_create_text_node(
+            &document->dom_document, text.data, text.size));
+        if (node == NULL)
+        {
+          throw std::runtime_error("failed to create text node");
+        }
+      }
+      else if (enif_get_tuple(env, item, &arity, &items) && arity == 3)
+      {
+        node = element_from_tree_item(env, document, items[0], items[1], ns);
+        children = items[2];
+      }
+      else if (enif_get_tuple(env, item, &arity, &items) && arity == 2)
+      {
+        if (!enif_is_identical(items[0], comment_atom))
+        {
+          if (enif_is_atom(env, items[0]))
+          {
+            throw std::invalid_argument(
+                "tuple contains unexpected atom: :" +
+                fine::decode<fine::Atom>(env, items[0]).to_string());
+          }
+
+          throw std::invalid_argument("expected a comment tuple");
+        }
+
+        auto content = decode_tree_binary(env, items[1], "comment content");
+
+        node = lxb_dom_interface_node(lxb_dom_document_create_comment(
+            &document->dom_document, content.data, content.size));
+        if (node == NULL)
+        {
+          throw std::runtime_error("failed to create comment node");
+        }
+      }
+      else
+      {
+        throw std::invalid_argument(
+            "expected a tree node, that is a binary, an element tuple or "
+            "a comment tuple");
+      }
+
+      lxb_dom_node_insert_child(parent, node);
+
+      if (is_root)
+      {
+        nodes.push_back(node);
+      }
+
+      if (children)
+      {
+        // <template> elements don't have direct children, instead they
+        // hold a document fragment node, so we insert into the fragment.
+        // Note that pushing invalidates the frame reference.
+        stack.push_back(
+            Frame{*children, template_aware_children_parent(node), ns});
+      }
+    }
+
+    return nodes;
+  }
+
+  ExLazyHTML from_tree(ErlNifEnv *env, fine::Term tree)
+  {
+    auto call = NifCall(NifId::FROM_TREE);
+
+    auto document = document_pool.acquire();
+    auto document_guard =
+        ScopeGuard([&]()
+                   { lxb_html_document_destroy(document); });
+
+    auto root = lxb_dom_interface_node(document);
+    auto nodes = nodes_from_tree(env, document, root, tree);
+
+    auto document_ref = std::make_shared<DocumentRef>(document, root);
+    document_guard.deactivate();
+
+    return ExLazyHTML(fine::make_resource<LazyHTML>(document_ref, nodes, false));
+  }
+
+  FINE_NIF(from_tree, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  // Creates a copy of the given node in document, without children.
+  // Returns NULL for node types that are not copied.
+  lxb_dom_node_t *copy_node(lxb_html_document_t *document,
+                            lxb_dom_node_t *node)
+  {
+    if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+    {
+      auto source = lxb_dom_interface_element(node);
+
+      size_t name_length;
+      auto name = lxb_dom_element_qualified_name(source, &name_length);
       if (name == NULL)
       {
-        throw std::runtime_error("failed to read tag name");
+        throw std::runtime_error("failed to read tag name");
+      }
+
+      auto element = lxb_dom_document_create_element(
+          &document->dom_document, name, name_length, NULL);
+      if (element == NULL)
+      {
+        throw std::runtime_error("failed to create element");
+      }
+
+      // We copy the namespace before the attributes, so that attribute
+      // names of foreign elements keep their casing.
+      lxb_dom_interface_node(element)->ns = node->ns;
+
+      for (auto attr = lxb_dom_element_first_attribute(source); attr != NULL;
+           attr = lxb_dom_element_next_attribute(attr))
+      {
+        size_t attr_name_length;
+        auto attr_name = lxb_dom_attr_qualified_name(attr, &attr_name_length);
+
+        size_t value_length;
+        auto value = lxb_dom_attr_value(attr, &value_length);
+
+        auto new_attr = lxb_dom_element_set_attribute(
+            element, attr_name, attr_name_length, value, value_length);
+        if (new_attr == NULL)
+        {
+          throw std::runtime_error("failed to set element attribute");
+        }
+      }
+
+      return lxb_dom_interface_node(element);
+    }
+    else if (node->type == LXB_DOM_NODE_TYPE_TEXT)
+    {
+      auto character_data = lxb_dom_interface_character_data(node);
+      auto text = lxb_dom_document_create_text_node(
+          &document->dom_document, character_data->data.data,
+          character_data->data.length);
+      if (text == NULL)
+      {
+        throw std::runtime_error("failed to create text node");
+      }
+      return lxb_dom_interface_node(text);
+    }
+    else if (node->type == LXB_DOM_NODE_TYPE_COMMENT)
+    {
+      auto character_data = lxb_dom_interface_character_data(node);
+      auto comment = lxb_dom_document_create_comment(
+          &document->dom_document, character_data->data.data,
+          character_data->data.length);
+      if (comment == NULL)
+      {
+        throw std::runtime_error("failed to create comment node");
+      }
+      return lxb_dom_interface_node(comment);
+    }
+    else if (node->type == LXB_DOM_NODE_TYPE_DOCUMENT_TYPE)
+    {
+      // Doctype names are interned per document, so we let lexbor
+      // copy the name along with the public and system ids.
+      auto doctype =
+          lxb_dom_document_import_node(&document->dom_document, node, false);
+      if (doctype == NULL)
+      {
+        throw std::runtime_error("failed to copy doctype node");
+      }
+      return doctype;
+    }
+
+    return NULL;
+  }
+
+  // Copies the subtrees of roots into document, inserting the copied
+  // roots as children of parent, unless it is NULL. If mapping is
+  // given, copies of the nodes that are among its keys are stored as
+  // its values. Returns the copied roots and the number of visited
+  // nodes.
+  std::tuple<std::vector<lxb_dom_node_t *>, size_t> copy_subtrees(
+      lxb_html_document_t *document, std::vector<lxb_dom_node_t *> roots,
+      lxb_dom_node_t *parent,
+      std::unordered_map<lxb_dom_node_t *, lxb_dom_node_t *> *mapping = NULL)
+  {
+    auto nodes = std::vector<lxb_dom_node_t *>();
+
+    // The copies of the elements we are currently within.
+    auto parents = std::vector<lxb_dom_node_t *>();
+
+    auto walker = TreeWalker(roots);
+
+    while (walker.next())
+    {
+      auto node = walker.node();
+
+      if (walker.event() == TreeWalker::LEAVE)
+      {
+        parents.pop_back();
+        continue;
+      }
+
+      auto node_copy = copy_node(document, node);
+      if (node_copy == NULL)
+      {
+        continue;
+      }
+
+      if (mapping != NULL)
+      {
+        auto it = mapping->find(node);
+        if (it != mapping->end())
+        {
+          it->second = node_copy;
+        }
+      }
+
+      if (parents.empty())
+      {
+        if (parent != NULL)
+        {
+          lxb_dom_node_insert_child(parent, node_copy);
+        }
+        nodes.push_back(node_copy);
+      }
+      else
+      {
+        lxb_dom_node_insert_child(
+            template_aware_children_parent(parents.back()), node_copy);
+      }
+
+      if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+      {
+        parents.push_back(node_copy);
+      }
+    }
+
+    return std::make_tuple(nodes, walker.visited());
+  }
+
+  // Returns a new empty document, with the same compat mode as source.
+  lxb_html_document_t *new_document_like(lxb_html_document_t *source)
+  {
+    auto document = document_pool.acquire();
+
+    // Selector matching depends on the compat mode, for example class
+    // names are case-insensitive in quirks mode, so we keep it.
+    document->dom_document.compat_mode = source->dom_document.compat_mode;
+
+    return document;
+  }
+
+  ExLazyHTML detach(ErlNifEnv *env, ExLazyHTML ex_lazy_html)
+  {
+    auto call = NifCall(NifId::DETACH);
+
+    auto document =
+        new_document_like(ex_lazy_html.resource->document_ref->document);
+    auto document_guard =
+        ScopeGuard([&]()
+                   { lxb_html_document_destroy(document); });
+
+    auto root = lxb_dom_interface_node(document);
+    auto [nodes, visited] =
+        copy_subtrees(document, ex_lazy_html.resource->nodes, root);
+
+    call.add_nodes(visited);
+
+    auto document_ref = std::make_shared<DocumentRef>(document, root);
+    document_guard.deactivate();
+
+    return ExLazyHTML(fine::make_resource<LazyHTML>(
+        document_ref, nodes, ex_lazy_html.resource->from_selector));
+  }
+
+  FINE_NIF(detach, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  ExLazyHTML document(ErlNifEnv *env, ExLazyHTML ex_lazy_html)
+  {
+    auto &document_ref = ex_lazy_html.resource->document_ref;
+
+    return ExLazyHTML(fine::make_resource<LazyHTML>(
+        document_ref, child_nodes_of(document_ref->root), false));
+  }
+
+  FINE_NIF(document, 0);
+
+  // Calls fun with a copy of the document of lazy_html and the copies
+  // of its nodes, and returns the copied nodes.
+  //
+  // Documents are shared by all resources derived from them, such as
+  // query results, and may be read concurrently, so they are never
+  // modified. Instead we copy the whole document, modify the copy and
+  // return the corresponding nodes of the copy. Several modifications
+  // can be applied to a single copy, see modify.
+  template <typename Fun>
+  ExLazyHTML modify_copy(NifCall &call, ExLazyHTML ex_lazy_html, Fun fun)
+  {
+    auto &resource = *ex_lazy_html.resource;
+    auto &source = *resource.document_ref;
+
+    call.add_nodes(resource.nodes.size());
+
+    auto document = new_document_like(source.document);
+    auto document_guard =
+        ScopeGuard([&]()
+                   { lxb_html_document_destroy(document); });
+
+    auto mapping = std::unordered_map<lxb_dom_node_t *, lxb_dom_node_t *>();
+    for (auto node : resource.nodes)
+    {
+      mapping.emplace(node, nullptr);
+    }
+
+    auto root = lxb_dom_interface_node(document);
+    call.add_nodes(std::get<1>(
+        copy_subtrees(document, child_nodes_of(source.root), root, &mapping)));
+
+    for (auto node : resource.nodes)
+    {
+      // Nodes that are not part of the document anymore, such as removed
+      // ones, are copied without a parent.
+      if (mapping[node] == NULL)
+      {
+        call.add_nodes(
+            std::get<1>(copy_subtrees(document, {node}, NULL, &mapping)));
       }
-      auto name_term = make_new_binary(env, name_length, name);
-
-      auto attrs_term = attributes_to_term(env, element, sort_attributes);
+    }
 
-      auto children = std::vector<ERL_NIF_TERM>();
-      for (auto child = template_aware_first_child(node); child != NULL;
-           child = lxb_dom_node_next(child))
+    auto nodes = std::vector<lxb_dom_node_t *>();
+    for (auto node : resource.nodes)
+    {
+      // Node types that are not copied are dropped.
+      if (auto node_copy = mapping[node])
       {
-        node_to_tree(env, resource, child, children, sort_attributes,
-                     skip_whitespace_nodes);
+        nodes.push_back(node_copy);
       }
+    }
+
+    fun(document, nodes);
+
+    // The memory is measured here, so it includes the modifications.
+    auto document_ref = std::make_shared<DocumentRef>(document, root);
+    document_guard.deactivate();
+
+    return ExLazyHTML(fine::make_resource<LazyHTML>(
+        document_ref, nodes, resource.from_selector));
+  }
+
+  // Applies fun to every node of lazy_html, in a copy of its document.
+  template <typename Fun>
+  ExLazyHTML modify_nodes(NifCall &call, ExLazyHTML ex_lazy_html, Fun fun)
+  {
+    return modify_copy(call, ex_lazy_html,
+                       [&](lxb_html_document_t *document,
+                           const std::vector<lxb_dom_node_t *> &nodes)
+                       {
+                         for (auto node : nodes)
+                         {
+                           fun(document, node);
+                         }
+                       });
+  }
+
+  // Parses html as children of context and returns the parse root,
+  // which holds the parsed nodes. Nodes without an element context are
+  // parsed as children of <body>.
+  lxb_dom_node_t *parse_fragment_in(lxb_html_document_t *document,
+                                    lxb_dom_node_t *context,
+                                    ErlNifBinary html)
+  {
+    auto context_element =
+        context != NULL && context->type == LXB_DOM_NODE_TYPE_ELEMENT
+            ? lxb_dom_interface_element(context)
+            : lxb_dom_document_create_element(
+                  &document->dom_document,
+                  reinterpret_cast<const lxb_char_t *>("body"), 4, NULL);
+
+    auto parse_root = lxb_html_document_parse_fragment(
+        document, context_element, html.data, html.size);
+    if (parse_root == NULL)
+    {
+      throw std::runtime_error("failed to parse html fragment");
+    }
+
+    return parse_root;
+  }
 
-      auto children_term = enif_make_list_from_array(
-          env, children.data(), static_cast<unsigned int>(children.size()));
+  // Modifications of a single node, shared by the modification NIFs and
+  // modify. Nodes of unsupported types are left as is.
 
-      tree.push_back(enif_make_tuple3(env, name_term, attrs_term, children_term));
+  void set_node_attribute(lxb_dom_node_t *node, ErlNifBinary name,
+                          ErlNifBinary value)
+  {
+    if (node->type != LXB_DOM_NODE_TYPE_ELEMENT)
+    {
+      return;
     }
-    else if (node->type == LXB_DOM_NODE_TYPE_TEXT)
+
+    auto attr = lxb_dom_element_set_attribute(lxb_dom_interface_element(node),
+                                              name.data, name.size,
+                                              value.data, value.size);
+    if (attr == NULL)
     {
-      auto character_data = lxb_dom_interface_character_data(node);
+      throw std::runtime_error("failed to set element attribute");
+    }
+  }
 
-      auto whitespace_size = leading_whitespace_size(character_data->data.data,
-                                                     character_data->data.length);
+  void remove_node_attribute(lxb_dom_node_t *node, ErlNifBinary name)
+  {
+    if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+    {
+      lxb_dom_element_remove_attribute(lxb_dom_interface_element(node),
+                                       name.data, name.size);
+    }
+  }
+
+  // Removed nodes are only detached, they are freed together with the
+  // document.
+  void remove_node(lxb_dom_node_t *node) { lxb_dom_node_remove(node); }
+
+  void replace_node_with_html(lxb_html_document_t *document,
+                              lxb_dom_node_t *node, ErlNifBinary html)
+  {
+    if (node->parent == NULL)
+    {
+      return;
+    }
+
+    auto parse_root = parse_fragment_in(document, node->parent, html);
+
+    while (auto child = lxb_dom_node_first_child(parse_root))
+    {
+      lxb_dom_node_remove(child);
+      lxb_dom_node_insert_before(node, child);
+    }
+
+    lxb_dom_node_remove(node);
+  }
 
-      if (whitespace_size == character_data->data.length &&
-          skip_whitespace_nodes)
+  void append_node_html(lxb_html_document_t *document, lxb_dom_node_t *node,
+                        ErlNifBinary html)
+  {
+    if (node->type != LXB_DOM_NODE_TYPE_ELEMENT)
+    {
+      return;
+    }
+
+    auto parse_root = parse_fragment_in(document, node, html);
+    auto parent = template_aware_children_parent(node);
+
+    while (auto child = lxb_dom_node_first_child(parse_root))
+    {
+      lxb_dom_node_remove(child);
+      lxb_dom_node_insert_child(parent, child);
+    }
+  }
+
+  void set_node_text(lxb_html_document_t *document, lxb_dom_node_t *node,
+                     ErlNifBinary text)
+  {
+    if (node->type == LXB_DOM_NODE_TYPE_TEXT ||
+        node->type == LXB_DOM_NODE_TYPE_COMMENT)
+    {
+      auto character_data = lxb_dom_interface_character_data(node);
+      auto status = lxb_dom_character_data_replace(
+          character_data, text.data, text.size, 0, character_data->data.length);
+      if (status != LXB_STATUS_OK)
       {
-        // Append nothing
+        throw std::runtime_error("failed to set node text");
       }
-      else
+      return;
+    }
+
+    if (node->type != LXB_DOM_NODE_TYPE_ELEMENT)
+    {
+      return;
+    }
+
+    auto parent = template_aware_children_parent(node);
+
+    while (auto child = lxb_dom_node_first_child(parent))
+    {
+      lxb_dom_node_remove(child);
+    }
+
+    if (text.size > 0)
+    {
+      auto text_node = lxb_dom_document_create_text_node(
+          &document->dom_document, text.data, text.size);
+      if (text_node == NULL)
       {
-        auto term = fine::make_resource_binary(
-            env, resource, reinterpret_cast<char *>(character_data->data.data),
-            character_data->data.length);
-        tree.push_back(term);
+        throw std::runtime_error("failed to create text node");
       }
+      lxb_dom_node_insert_child(parent, lxb_dom_interface_node(text_node));
     }
-    else if (node->type == LXB_DOM_NODE_TYPE_COMMENT)
+  }
+
+  ExLazyHTML set_attribute(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                           ErlNifBinary name, ErlNifBinary value)
+  {
+    auto call = NifCall(NifId::SET_ATTRIBUTE);
+    call.add_bytes_in(name.size + value.size);
+
+    return modify_nodes(call, ex_lazy_html,
+                        [&](lxb_html_document_t *document, lxb_dom_node_t *node)
+                        { set_node_attribute(node, name, value); });
+  }
+
+  FINE_NIF(set_attribute, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  ExLazyHTML remove_attribute(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                              ErlNifBinary name)
+  {
+    auto call = NifCall(NifId::REMOVE_ATTRIBUTE);
+    call.add_bytes_in(name.size);
+
+    return modify_nodes(call, ex_lazy_html,
+                        [&](lxb_html_document_t *document, lxb_dom_node_t *node)
+                        { remove_node_attribute(node, name); });
+  }
+
+  FINE_NIF(remove_attribute, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  ExLazyHTML remove(ErlNifEnv *env, ExLazyHTML ex_lazy_html)
+  {
+    auto call = NifCall(NifId::REMOVE);
+
+    return modify_nodes(call, ex_lazy_html,
+                        [&](lxb_html_document_t *document, lxb_dom_node_t *node)
+                        { remove_node(node); });
+  }
+
+  FINE_NIF(remove, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  ExLazyHTML replace_with_html(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                               ErlNifBinary html)
+  {
+    auto call = NifCall(NifId::REPLACE_WITH_HTML);
+    call.add_bytes_in(html.size);
+
+    return modify_nodes(call, ex_lazy_html,
+                        [&](lxb_html_document_t *document, lxb_dom_node_t *node)
+                        { replace_node_with_html(document, node, html); });
+  }
+
+  FINE_NIF(replace_with_html, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  ExLazyHTML append_html(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                         ErlNifBinary html)
+  {
+    auto call = NifCall(NifId::APPEND_HTML);
+    call.add_bytes_in(html.size);
+
+    return modify_nodes(call, ex_lazy_html,
+                        [&](lxb_html_document_t *document, lxb_dom_node_t *node)
+                        { append_node_html(document, node, html); });
+  }
+
+  FINE_NIF(append_html, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  ExLazyHTML set_text(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                      ErlNifBinary text)
+  {
+    auto call = NifCall(NifId::SET_TEXT);
+    call.add_bytes_in(text.size);
+
+    return modify_nodes(call, ex_lazy_html,
+                        [&](lxb_html_document_t *document, lxb_dom_node_t *node)
+                        { set_node_text(document, node, text); });
+  }
+
+  FINE_NIF(set_text, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  lxb_css_selector_list_t *parse_css_selector(lxb_css_parser_t *parser,
+                                              ErlNifBinary css_selector)
+  {
+    auto css_selector_list =
+        lxb_css_selectors_parse(parser, css_selector.data, css_selector.size);
+    if (parser->status == LXB_STATUS_ERROR_UNEXPECTED_DATA)
     {
-      auto character_data = lxb_dom_interface_character_data(node);
-      auto term = fine::make_resource_binary(
-          env, resource, reinterpret_cast<char *>(character_data->data.data),
-          character_data->data.length);
-      tree.push_back(
-          enif_make_tuple2(env, fine::encode(env, atoms::comment), term));
+      throw std::invalid_argument(
+          "got invalid css selector: " +
+          std::string(reinterpret_cast<char *>(css_selector.data),
+                      css_selector.size));
+    }
+    if (parser->status != LXB_STATUS_OK)
+    {
+      throw std::runtime_error("failed to parse css selector");
     }
+
+    return css_selector_list;
   }
 
-  fine::Term to_tree(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
-                     bool sort_attributes, bool skip_whitespace_nodes)
+  using SelectorIndexKey = std::pair<SelectorIndex::Kind, std::string>;
+
+  // Returns the selector index keys for the given selector list, such
+  // that every matching element is indexed under each of the keys. An
+  // empty result means the selectors cannot be answered from the index.
+  //
+  // We only handle a single compound selector, such as div.card or
+  // a[href], because its matches do not depend on other elements.
+  std::vector<SelectorIndexKey>
+  selector_index_keys(lxb_css_selector_list_t *list)
   {
-    auto tree = std::vector<ERL_NIF_TERM>();
+    auto keys = std::vector<SelectorIndexKey>();
 
-    for (auto node : ex_lazy_html.resource->nodes)
+    if (list->next != NULL)
     {
-      node_to_tree(env, ex_lazy_html.resource, node, tree, sort_attributes,
-                   skip_whitespace_nodes);
+      return keys;
     }
 
-    return enif_make_list_from_array(env, tree.data(),
-                                     static_cast<unsigned int>(tree.size()));
+    for (auto selector = list->first; selector != NULL;
+         selector = selector->next)
+    {
+      if (selector != list->first &&
+          selector->combinator != LXB_CSS_SELECTOR_COMBINATOR_CLOSE)
+      {
+        return std::vector<SelectorIndexKey>();
+      }
+
+      auto name = ascii_lowercase(selector->name.data, selector->name.length);
+
+      switch (selector->type)
+      {
+      case LXB_CSS_SELECTOR_TYPE_ELEMENT:
+        if (selector->ns.length == 0)
+        {
+          keys.emplace_back(SelectorIndex::TAG, name);
+        }
+        break;
+
+      case LXB_CSS_SELECTOR_TYPE_ID:
+        keys.emplace_back(SelectorIndex::ID, name);
+        break;
+
+      case LXB_CSS_SELECTOR_TYPE_CLASS:
+        keys.emplace_back(SelectorIndex::CLASS, name);
+        break;
+
+      case LXB_CSS_SELECTOR_TYPE_ATTRIBUTE:
+        if (selector->ns.length == 0)
+        {
+          keys.emplace_back(SelectorIndex::ATTRIBUTE, name);
+        }
+        break;
+
+      default:
+        break;
+      }
+    }
+
+    return keys;
   }
 
-  FINE_NIF(to_tree, 0);
+  // Owns a parsed selector list. The list does not reference the parser
+  // that produced it, so it can be matched any number of times, from
+  // any thread, for as long as it is alive.
+  struct SelectorList
+  {
+    lxb_css_selector_list_t *list;
+    std::vector<SelectorIndexKey> index_keys;
 
-  std::optional<uintptr_t> get_tag_namespace(ErlNifBinary name)
+    SelectorList(lxb_css_selector_list_t *list)
+        : list(list), index_keys(selector_index_keys(list)) {}
+
+    ~SelectorList() { lxb_css_selector_list_destroy_memory(this->list); }
+  };
+
+  std::shared_ptr<SelectorList> compile_css_selector(ErlNifBinary css_selector)
   {
-    if (strncmp("svg", reinterpret_cast<char *>(name.data), name.size) == 0)
+    auto parser = lxb_css_parser_create();
+    auto status = lxb_css_parser_init(parser, NULL);
+    if (status != LXB_STATUS_OK)
     {
-      // For SVG we explicitly set the namespace, similar to
-      // `document.createElementNS`. It is important because attribute
-      // names are lowercased for HTML elements, but should not be
-      // lowercased inside SVG.
-      return LXB_NS_SVG;
+      throw std::runtime_error("failed to create css parser");
     }
+    auto parser_guard =
+        ScopeGuard([&]()
+                   { lxb_css_parser_destroy(parser, true); });
 
-    return std::nullopt;
+    auto css_selector_list = parse_css_selector(parser, css_selector);
+
+    return std::make_shared<SelectorList>(css_selector_list);
   }
 
-  lxb_dom_node_t *node_from_tree_item(ErlNifEnv *env,
-                                      lxb_html_document_t *document,
-                                      fine::Term item,
-                                      std::optional<uintptr_t> ns)
+  // A bounded LRU cache of compiled selectors, keyed by the selector
+  // string. Most applications use a small, fixed set of selectors, so
+  // this way each of them is parsed only once.
+  class SelectorCache
   {
-    using ExText = ErlNifBinary;
-    using ExElement =
-        std::tuple<ErlNifBinary,
-                   std::vector<std::tuple<ErlNifBinary, ErlNifBinary>>,
-                   std::vector<fine::Term>>;
-    using ExComment = std::tuple<fine::Atom, ErlNifBinary>;
-
-    auto decoded =
-        fine::decode<std::variant<ExText, ExElement, ExComment>>(env, item);
+  public:
+    SelectorCache(size_t capacity) : capacity(capacity) {}
 
-    if (auto text_ptr = std::get_if<ExText>(&decoded))
+    std::shared_ptr<SelectorList> get(ErlNifBinary css_selector)
     {
-      auto text = lxb_dom_document_create_text_node(
-          &document->dom_document, text_ptr->data, text_ptr->size);
-      if (text == NULL)
+      auto key = std::string(reinterpret_cast<char *>(css_selector.data),
+                             css_selector.size);
+
       {
-        throw std::runtime_error("failed to create text node");
+        auto lock = std::lock_guard<std::mutex>(this->mutex);
+
+        auto it = this->entries.find(key);
+        if (it != this->entries.end())
+        {
+          this->hits++;
+          this->lru.splice(this->lru.begin(), this->lru, it->second);
+          return it->second->second;
+        }
+
+        this->misses++;
       }
-      return lxb_dom_interface_node(text);
+
+      // We compile outside of the lock, so that parsing a new selector
+      // does not block lookups from other schedulers.
+      auto selector_list = compile_css_selector(css_selector);
+
+      auto lock = std::lock_guard<std::mutex>(this->mutex);
+
+      auto it = this->entries.find(key);
+      if (it != this->entries.end())
+      {
+        // Another thread compiled the same selector in the meantime.
+        return it->second->second;
+      }
+
+      this->lru.emplace_front(key, selector_list);
+      this->entries.emplace(key, this->lru.begin());
+
+      if (this->entries.size() > this->capacity)
+      {
+        this->entries.erase(this->lru.back().first);
+        this->lru.pop_back();
+      }
+
+      return selector_list;
+    }
+
+    // Returns the number of lookups that found a cached selector, the
+    // number of lookups that compiled it and the number of cached
+    // selectors.
+    std::tuple<uint64_t, uint64_t, uint64_t> stats()
+    {
+      auto lock = std::lock_guard<std::mutex>(this->mutex);
+      return std::make_tuple(this->hits, this->misses,
+                             static_cast<uint64_t>(this->entries.size()));
+    }
+
+  private:
+    using Entry = std::pair<std::string, std::shared_ptr<SelectorList>>;
+
+    size_t capacity;
+    std::mutex mutex;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+  };
+
+  auto selector_cache = SelectorCache(512);
+
+  struct Selector
+  {
+    std::shared_ptr<SelectorList> selector_list;
+
+    Selector(std::shared_ptr<SelectorList> selector_list)
+        : selector_list(selector_list) {}
+  };
+
+  FINE_RESOURCE(Selector);
+
+  struct ExSelector
+  {
+    fine::ResourcePtr<Selector> resource;
+
+    ExSelector() {}
+    ExSelector(fine::ResourcePtr<Selector> resource) : resource(resource) {}
+
+    static constexpr auto module = &atoms::ElixirLazyHTMLSelector;
+
+    static constexpr auto fields()
+    {
+      return std::make_tuple(
+          std::make_tuple(&ExSelector::resource, &atoms::resource));
     }
-    else if (auto element_ptr = std::get_if<ExElement>(&decoded))
+  };
+
+  // Selectors are given either as a string, which goes through the
+  // cache, or as a %LazyHTML.Selector{} compiled upfront.
+  using SelectorArg = std::variant<ErlNifBinary, ExSelector>;
+
+  std::shared_ptr<SelectorList> get_selector_list(SelectorArg &css_selector)
+  {
+    if (auto binary_ptr = std::get_if<ErlNifBinary>(&css_selector))
     {
-      const auto &[name, attributes, children_tree] = *element_ptr;
+      return selector_cache.get(*binary_ptr);
+    }
+
+    return std::get<ExSelector>(css_selector).resource->selector_list;
+  }
+
+  fine::ResourcePtr<Selector> compile_selector(ErlNifEnv *env,
+                                               ErlNifBinary css_selector)
+  {
+    auto call = NifCall(NifId::COMPILE_SELECTOR);
+    call.add_bytes_in(css_selector.size);
+
+    return fine::make_resource<Selector>(compile_css_selector(css_selector));
+  }
+
+  FINE_NIF(compile_selector, 0);
+
+  std::tuple<uint64_t, uint64_t, uint64_t> selector_cache_stats(ErlNifEnv *env)
+  {
+    return selector_cache.stats();
+  }
 
-      auto element = lxb_dom_document_create_element(&document->dom_document,
-                                                     name.data, name.size, NULL);
+  FINE_NIF(selector_cache_stats, 0);
 
-      auto node = lxb_dom_interface_node(element);
+  // Returns a selectors engine owned by the calling thread. The engine
+  // only keeps per-match state, so it can be reused across calls. NIFs
+  // run on scheduler threads, which live as long as the VM, hence we
+  // never destroy it.
+  lxb_selectors_t *thread_selectors(lxb_selectors_opt_t opts)
+  {
+    thread_local lxb_selectors_t *selectors = NULL;
 
-      if (!ns)
+    if (selectors == NULL)
+    {
+      auto new_selectors = lxb_selectors_create();
+      auto status = lxb_selectors_init(new_selectors);
+      if (status != LXB_STATUS_OK)
       {
-        ns = get_tag_namespace(name);
+        lxb_selectors_destroy(new_selectors, true);
+        throw std::runtime_error("failed to create selectors");
       }
+      selectors = new_selectors;
+    }
 
-      if (ns)
-      {
-        node->ns = ns.value();
-      }
+    lxb_selectors_opt_set(selectors, opts);
 
-      for (auto &[key, value] : attributes)
-      {
-        auto attr = lxb_dom_element_set_attribute(element, key.data, key.size,
-                                                  value.data, value.size);
-        if (attr == NULL)
-        {
-          throw std::runtime_error("failed to set element attribute");
-        }
-      }
+    return selectors;
+  }
 
-      if (lxb_html_tree_node_is(node, LXB_TAG_TEMPLATE))
-      {
-        // <template> elements don't have direct children, instead they hold
-        // a document fragment node, so we insert into the fragment instead.
-        node = &lxb_html_interface_template(node)->content->node;
-      }
+  lxb_status_t push_matched_node(lxb_dom_node_t *node,
+                                 lxb_css_selector_specificity_t spec,
+                                 void *ctx)
+  {
+    auto nodes_ptr = static_cast<std::vector<lxb_dom_node_t *> *>(ctx);
+    nodes_ptr->push_back(node);
+    return LXB_STATUS_OK;
+  }
 
-      for (auto child_item : children_tree)
-      {
-        auto child_node = node_from_tree_item(env, document, child_item, ns);
-        lxb_dom_node_insert_child(node, child_node);
-      }
+  // Queries with at least this many roots are split into chunks, which
+  // are matched in parallel on the worker pool.
+  constexpr size_t parallel_query_min_roots = 512;
+  constexpr size_t parallel_query_chunk_roots = 128;
+
+  // Appends all elements matching the selector list within the subtrees
+  // of roots[start, end) to nodes. This uses the selectors engine of the
+  // calling thread, so it can be called from worker threads.
+  void query_roots(const SelectorIndex *index,
+                   const std::vector<SelectorIndex::Entry> *candidates,
+                   const std::vector<lxb_dom_node_t *> &roots, size_t start,
+                   size_t end, const SelectorList &selector_list,
+                   std::vector<lxb_dom_node_t *> &nodes)
+  {
+    // By default the find callback can be called multiple times with
+    // the same element, if it matches multiple selectors in the list.
+    // This options changes the behaviour, so that we get unique elements.
+    auto selectors = thread_selectors(static_cast<lxb_selectors_opt_t>(
+        LXB_SELECTORS_OPT_MATCH_FIRST | LXB_SELECTORS_OPT_MATCH_ROOT));
+    auto selectors_guard =
+        ScopeGuard([&]()
+                   { lxb_selectors_clean(selectors); });
 
-      return lxb_dom_interface_node(element);
-    }
-    else if (auto comment_ptr = std::get_if<ExComment>(&decoded))
+    for (auto i = start; i < end; i++)
     {
-      const auto &[atom, content] = *comment_ptr;
+      auto node = roots[i];
 
-      if (!(atom == atoms::comment))
+      if (index != NULL)
       {
-        throw std::invalid_argument("tuple contains unexpected atom: :" +
-                                    atom.to_string());
+        if (auto range = index->subtree_range(node))
+        {
+          auto it = std::lower_bound(
+              candidates->begin(), candidates->end(), range->first,
+              [](const SelectorIndex::Entry &entry, size_t position)
+              { return entry.position < position; });
+
+          for (; it != candidates->end() && it->position < range->second; it++)
+          {
+            auto status = lxb_selectors_match_node(
+                selectors, it->node, selector_list.list, push_matched_node,
+                &nodes);
+            if (status != LXB_STATUS_OK)
+            {
+              throw std::runtime_error("failed to run match");
+            }
+          }
+
+          continue;
+        }
       }
 
-      auto comment = lxb_dom_document_create_comment(&document->dom_document,
-                                                     content.data, content.size);
-      if (comment == NULL)
+      auto status = lxb_selectors_find(selectors, node, selector_list.list,
+                                       push_matched_node, &nodes);
+      if (status != LXB_STATUS_OK)
       {
-        throw std::runtime_error("failed to create comment node");
+        throw std::runtime_error("failed to run find");
       }
-      return lxb_dom_interface_node(comment);
     }
-
-    throw std::logic_error("unreachable");
   }
 
-  ExLazyHTML from_tree(ErlNifEnv *env, std::vector<fine::Term> tree)
+  // Finds all elements matching the selector list within the subtrees
+  // of the given roots.
+  std::vector<lxb_dom_node_t *>
+  query_nodes(DocumentRef &document_ref,
+              const std::vector<lxb_dom_node_t *> &roots,
+              const SelectorList &selector_list)
   {
-    auto document = lxb_html_document_create();
-    if (document == NULL)
+    const SelectorIndex *index = NULL;
+    const std::vector<SelectorIndex::Entry> *candidates = NULL;
+
+    if (!selector_list.index_keys.empty())
     {
-      throw std::runtime_error("failed to create document");
+      index = document_ref.selector_index();
+    }
+
+    if (index != NULL)
+    {
+      // Every match is indexed under all of the keys, so we pick the
+      // key with the fewest candidates.
+      for (auto &[kind, name] : selector_list.index_keys)
+      {
+        auto &entries = index->lookup(kind, name);
+        if (candidates == NULL || entries.size() < candidates->size())
+        {
+          candidates = &entries;
+        }
+      }
     }
-    auto document_guard =
-        ScopeGuard([&]()
-                   { lxb_html_document_destroy(document); });
 
-    auto root = lxb_dom_interface_node(document);
     auto nodes = std::vector<lxb_dom_node_t *>();
 
-    for (auto tree_node : tree)
+    if (roots.size() < parallel_query_min_roots || worker_pool.get_size() == 0)
     {
-      auto node = node_from_tree_item(env, document, tree_node, std::nullopt);
-      lxb_dom_node_insert_child(root, lxb_dom_interface_node(node));
-      nodes.push_back(node);
+      query_roots(index, candidates, roots, 0, roots.size(), selector_list,
+                  nodes);
+      return nodes;
     }
 
-    auto document_ref = std::make_shared<DocumentRef>(document);
-    document_guard.deactivate();
+    // Each chunk collects its matches separately and we concatenate
+    // them in order, so the result is the same as for a sequential run.
+    auto num_chunks = (roots.size() + parallel_query_chunk_roots - 1) /
+                      parallel_query_chunk_roots;
+    auto chunk_nodes = std::vector<std::vector<lxb_dom_node_t *>>(num_chunks);
+    auto chunk_errors = std::vector<std::string>(num_chunks);
 
-    return ExLazyHTML(fine::make_resource<LazyHTML>(document_ref, nodes, false));
-  }
+    worker_pool.parallel_for(num_chunks, [&](size_t chunk)
+                             {
+      auto start = chunk * parallel_query_chunk_roots;
+      auto end = std::min(start + parallel_query_chunk_roots, roots.size());
 
-  FINE_NIF(from_tree, 0);
+      try
+      {
+        query_roots(index, candidates, roots, start, end, selector_list,
+                    chunk_nodes[chunk]);
+      }
+      catch (const std::exception &error)
+      {
+        chunk_errors[chunk] = error.what();
+      } });
 
-  lxb_css_selector_list_t *parse_css_selector(lxb_css_parser_t *parser,
-                                              ErlNifBinary css_selector)
-  {
-    auto css_selector_list =
-        lxb_css_selectors_parse(parser, css_selector.data, css_selector.size);
-    if (parser->status == LXB_STATUS_ERROR_UNEXPECTED_DATA)
+    for (size_t chunk = 0; chunk < num_chunks; chunk++)
     {
-      throw std::invalid_argument(
-          "got invalid css selector: " +
-          std::string(reinterpret_cast<char *>(css_selector.data),
-                      css_selector.size));
-    }
-    if (parser->status != LXB_STATUS_OK)
-    {
-      throw std::runtime_error("failed to parse css selector");
+      if (!chunk_errors[chunk].empty())
+      {
+        throw std::runtime_error(chunk_errors[chunk]);
+      }
+
+      nodes.insert(nodes.end(), chunk_nodes[chunk].begin(),
+                   chunk_nodes[chunk].end());
     }
 
-    return css_selector_list;
+    return nodes;
   }
 
   ExLazyHTML query(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
-                   ErlNifBinary css_selector)
+                   SelectorArg css_selector)
   {
-    auto parser = lxb_css_parser_create();
-    auto status = lxb_css_parser_init(parser, NULL);
-    if (status != LXB_STATUS_OK)
-    {
-      throw std::runtime_error("failed to create css parser");
-    }
-    auto parser_guard =
-        ScopeGuard([&]()
-                   { lxb_css_parser_destroy(parser, true); });
+    auto call = NifCall(NifId::QUERY);
+    auto selector_list = get_selector_list(css_selector);
+    auto &lazy_html = *ex_lazy_html.resource;
 
-    auto css_selector_list = parse_css_selector(parser, css_selector);
-    auto css_selector_list_guard = ScopeGuard(
-        [&]()
-        { lxb_css_selector_list_destroy_memory(css_selector_list); });
+    auto nodes =
+        query_nodes(*lazy_html.document_ref, lazy_html.nodes, *selector_list);
+    call.add_nodes(nodes.size());
 
-    auto selectors = lxb_selectors_create();
-    status = lxb_selectors_init(selectors);
-    if (status != LXB_STATUS_OK)
+    return ExLazyHTML(
+        fine::make_resource<LazyHTML>(lazy_html.document_ref, nodes, true));
+  }
+
+  FINE_NIF(query, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  std::vector<ExLazyHTML> query_many(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                                     std::vector<SelectorArg> css_selectors)
+  {
+    auto call = NifCall(NifId::QUERY_MANY);
+
+    auto selector_lists = std::vector<std::shared_ptr<SelectorList>>();
+    for (auto &css_selector : css_selectors)
     {
-      throw std::runtime_error("failed to create selectors");
+      selector_lists.push_back(get_selector_list(css_selector));
     }
+
+    auto selectors = thread_selectors(LXB_SELECTORS_OPT_MATCH_FIRST);
     auto selectors_guard =
         ScopeGuard([&]()
-                   { lxb_selectors_destroy(selectors, true); });
+                   { lxb_selectors_clean(selectors); });
 
-    // By default the find callback can be called multiple times with
-    // the same element, if it matches multiple selectors in the list.
-    // This options changes the behaviour, so that we get unique elements.
-    lxb_selectors_opt_set(selectors, static_cast<lxb_selectors_opt_t>(
-                                         LXB_SELECTORS_OPT_MATCH_FIRST |
-                                         LXB_SELECTORS_OPT_MATCH_ROOT));
+    auto matches =
+        std::vector<std::vector<lxb_dom_node_t *>>(selector_lists.size());
 
-    auto nodes = std::vector<lxb_dom_node_t *>();
+    // Instead of running find for every selector, we walk the tree once
+    // and match each element against all of the selectors. We visit the
+    // same nodes as find does with LXB_SELECTORS_OPT_MATCH_ROOT, so the
+    // results are the same as for query.
+    auto walker = TreeWalker(ex_lazy_html.resource->nodes, false);
 
-    for (auto node : ex_lazy_html.resource->nodes)
+    while (walker.next())
     {
-      status = lxb_selectors_find(
-          selectors, node, css_selector_list,
-          [](lxb_dom_node_t *node, lxb_css_selector_specificity_t spec,
-             void *ctx) -> lxb_status_t
-          {
-            auto nodes_ptr = static_cast<std::vector<lxb_dom_node_t *> *>(ctx);
-            nodes_ptr->push_back(node);
-            return LXB_STATUS_OK;
-          },
-          &nodes);
-      if (status != LXB_STATUS_OK)
+      auto node = walker.node();
+
+      if (walker.event() != TreeWalker::ENTER ||
+          node->type != LXB_DOM_NODE_TYPE_ELEMENT)
       {
-        throw std::runtime_error("failed to run find");
+        continue;
+      }
+
+      for (size_t i = 0; i < selector_lists.size(); i++)
+      {
+        auto status = lxb_selectors_match_node(
+            selectors, node, selector_lists[i]->list, push_matched_node,
+            &matches[i]);
+        if (status != LXB_STATUS_OK)
+        {
+          throw std::runtime_error("failed to run match");
+        }
       }
     }
 
-    return ExLazyHTML(fine::make_resource<LazyHTML>(
-        ex_lazy_html.resource->document_ref, nodes, true));
+    auto results = std::vector<ExLazyHTML>();
+    for (auto &nodes : matches)
+    {
+      call.add_nodes(nodes.size());
+      results.push_back(ExLazyHTML(fine::make_resource<LazyHTML>(
+          ex_lazy_html.resource->document_ref, nodes, true)));
+    }
+
+    return results;
   }
 
-  FINE_NIF(query, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+  FINE_NIF(query_many, ERL_NIF_DIRTY_JOB_CPU_BOUND);
 
   ExLazyHTML filter(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
-                    ErlNifBinary css_selector)
+                    SelectorArg css_selector)
   {
-    auto parser = lxb_css_parser_create();
-    auto status = lxb_css_parser_init(parser, NULL);
-    if (status != LXB_STATUS_OK)
-    {
-      throw std::runtime_error("failed to create css parser");
-    }
-    auto parser_guard =
-        ScopeGuard([&]()
-                   { lxb_css_parser_destroy(parser, true); });
-
-    auto css_selector_list = parse_css_selector(parser, css_selector);
-    auto css_selector_list_guard = ScopeGuard(
-        [&]()
-        { lxb_css_selector_list_destroy_memory(css_selector_list); });
-
-    auto selectors = lxb_selectors_create();
-    status = lxb_selectors_init(selectors);
-    if (status != LXB_STATUS_OK)
-    {
-      throw std::runtime_error("failed to create selectors");
-    }
-    auto selectors_guard =
-        ScopeGuard([&]()
-                   { lxb_selectors_destroy(selectors, true); });
+    auto call = NifCall(NifId::FILTER);
+    auto selector_list = get_selector_list(css_selector);
 
     // By default the find callback can be called multiple times with
     // the same element, if it matches multiple selectors in the list.
     // This options changes the behaviour, so that we get unique elements.
-    lxb_selectors_opt_set(selectors, LXB_SELECTORS_OPT_MATCH_FIRST);
+    auto selectors = thread_selectors(LXB_SELECTORS_OPT_MATCH_FIRST);
+    auto selectors_guard =
+        ScopeGuard([&]()
+                   { lxb_selectors_clean(selectors); });
 
     auto nodes = std::vector<lxb_dom_node_t *>();
 
     for (auto node : ex_lazy_html.resource->nodes)
     {
-      status = lxb_selectors_match_node(
-          selectors, node, css_selector_list,
-          [](lxb_dom_node_t *node, lxb_css_selector_specificity_t spec,
-             void *ctx) -> lxb_status_t
-          {
-            auto nodes_ptr = static_cast<std::vector<lxb_dom_node_t *> *>(ctx);
-            nodes_ptr->push_back(node);
-            return LXB_STATUS_OK;
-          },
-          &nodes);
+      auto status = lxb_selectors_match_node(
+          selectors, node, selector_list->list, push_matched_node, &nodes);
       if (status != LXB_STATUS_OK)
       {
         throw std::runtime_error("failed to run match");
       }
     }
 
+    call.add_nodes(nodes.size());
+
     return ExLazyHTML(fine::make_resource<LazyHTML>(
         ex_lazy_html.resource->document_ref, nodes, true));
   }
 
   FINE_NIF(filter, 0);
 
-  bool matches_id(lxb_dom_node_t *node, ErlNifBinary *id)
+  ExLazyHTML query_by_id(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                         ErlNifBinary id)
   {
-    if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
-    {
-      auto element = lxb_dom_interface_element(node);
+    auto call = NifCall(NifId::QUERY_BY_ID);
+    auto &lazy_html = *ex_lazy_html.resource;
 
-      size_t value_length;
-      auto value = lxb_dom_element_get_attribute(
-          element, reinterpret_cast<const lxb_char_t *>("id"), 2, &value_length);
+    auto &candidates = lazy_html.document_ref->elements_by_id(std::string_view(
+        reinterpret_cast<const char *>(id.data), id.size));
 
-      if (value != NULL && value_length == id->size &&
-          lexbor_str_data_ncmp(value, id->data, id->size))
-      {
-        return true;
-      }
-    }
+    auto nodes = std::vector<lxb_dom_node_t *>();
 
-    return false;
-  }
+    if (candidates.empty())
+    {
+      return ExLazyHTML(fine::make_resource<LazyHTML>(
+          lazy_html.document_ref, nodes, true));
+    }
 
-  ExLazyHTML query_by_id(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
-                         ErlNifBinary id)
-  {
-    auto nodes = std::vector<lxb_dom_node_t *>();
+    // We want the same result as walking each root subtree in order,
+    // so for every candidate we find the roots it is contained in, by
+    // walking up its ancestors, and then group the matches by root.
+    auto root_positions =
+        std::unordered_map<lxb_dom_node_t *, std::vector<size_t>>();
+    for (size_t i = 0; i < lazy_html.nodes.size(); i++)
+    {
+      root_positions[lazy_html.nodes[i]].push_back(i);
+    }
 
-    auto ctx = std::make_tuple(&nodes, &id);
+    auto matches = std::vector<std::pair<size_t, lxb_dom_node_t *>>();
 
-    for (auto node : ex_lazy_html.resource->nodes)
+    for (auto candidate : candidates)
     {
-      if (matches_id(node, &id))
+      for (auto node = candidate; node != NULL; node = node->parent)
       {
-        nodes.push_back(node);
+        auto it = root_positions.find(node);
+        if (it != root_positions.end())
+        {
+          for (auto position : it->second)
+          {
+            matches.push_back(std::make_pair(position, candidate));
+          }
+        }
       }
+    }
 
-      lxb_dom_node_simple_walk(
-          node,
-          [](lxb_dom_node_t *node, void *ctx) -> lexbor_action_t
-          {
-            auto [nodes_ptr, id_ptr] = *static_cast<
-                std::tuple<std::vector<lxb_dom_node_t *> *, ErlNifBinary *> *>(
-                ctx);
-            if (matches_id(node, id_ptr))
-            {
-              nodes_ptr->push_back(node);
-            }
+    // Candidates are in document order, so a stable sort keeps them
+    // ordered within each root.
+    std::stable_sort(matches.begin(), matches.end(),
+                     [](const auto &left, const auto &right)
+                     { return left.first < right.first; });
 
-            return LEXBOR_ACTION_OK;
-          },
-          &ctx);
+    for (auto &match : matches)
+    {
+      nodes.push_back(match.second);
     }
 
-    return ExLazyHTML(fine::make_resource<LazyHTML>(
-        ex_lazy_html.resource->document_ref, nodes, true));
+    call.add_nodes(nodes.size());
+
+    return ExLazyHTML(
+        fine::make_resource<LazyHTML>(lazy_html.document_ref, nodes, true));
   }
 
   FINE_NIF(query_by_id, 0);
 
   ExLazyHTML child_nodes(ErlNifEnv *env, ExLazyHTML ex_lazy_html)
   {
+    auto call = NifCall(NifId::CHILD_NODES);
     auto nodes = std::vector<lxb_dom_node_t *>();
 
     for (auto node : ex_lazy_html.resource->nodes)
@@ -847,48 +3494,62 @@ namespace lazy_html
       }
     }
 
+    call.add_nodes(nodes.size());
+
     return ExLazyHTML(fine::make_resource<LazyHTML>(
         ex_lazy_html.resource->document_ref, nodes, true));
   }
 
   FINE_NIF(child_nodes, 0);
 
-  std::string text(ErlNifEnv *env, ExLazyHTML ex_lazy_html)
+  // Returns the concatenated text of the given nodes and their
+  // descendants, the same as textContent, but without allocating an
+  // intermediate string per node.
+  fine::Term nodes_text(ErlNifEnv *env,
+                        const std::vector<lxb_dom_node_t *> &nodes,
+                        const TextOptions &options)
   {
-    auto document = ex_lazy_html.resource->document_ref->document;
+    auto buffer = BinaryBuffer();
+    auto writer = TextWriter<BinaryBuffer>(buffer, options);
+    writer.write(nodes);
+    return buffer.make_term(env);
+  }
 
-    auto content = std::string();
+  fine::Term text(ErlNifEnv *env, ExLazyHTML ex_lazy_html, bool visible_only,
+                  std::optional<ErlNifBinary> block_separator,
+                  bool collapse_whitespace)
+  {
+    auto call = NifCall(NifId::TEXT);
+    auto options = TextOptions();
+    options.visible_only = visible_only;
+    options.collapse_whitespace = collapse_whitespace;
 
-    for (auto node : ex_lazy_html.resource->nodes)
+    if (block_separator)
     {
-      if (node->type == LXB_DOM_NODE_TYPE_ELEMENT ||
-          node->type == LXB_DOM_NODE_TYPE_TEXT)
-      {
-        size_t size;
-        auto text = lxb_dom_node_text_content(node, &size);
-        if (text == NULL)
-        {
-          throw std::runtime_error("failed to get element text content");
-        }
-        auto text_guard = ScopeGuard([&]()
-                                     { lxb_dom_document_destroy_text(lxb_dom_interface_document(document),
-                                                                     text); });
-
-        content.append(reinterpret_cast<char *>(text), size);
-      }
+      options.block_separator = std::string_view(
+          reinterpret_cast<const char *>(block_separator->data),
+          block_separator->size);
     }
 
-    return content;
+    auto buffer = BinaryBuffer();
+    auto writer = TextWriter<BinaryBuffer>(buffer, options);
+    writer.write(ex_lazy_html.resource->nodes);
+
+    call.add_nodes(writer.nodes_visited());
+    call.add_bytes_out(buffer.size());
+
+    return buffer.make_term(env);
   }
 
   FINE_NIF(text, 0);
 
-  std::vector<fine::Term> attribute(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
-                                    ErlNifBinary name)
+  std::vector<fine::Term>
+  nodes_attribute(ErlNifEnv *env, const std::vector<lxb_dom_node_t *> &nodes,
+                  ErlNifBinary name)
   {
     auto values = std::vector<fine::Term>();
 
-    for (auto node : ex_lazy_html.resource->nodes)
+    for (auto node : nodes)
     {
       if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
       {
@@ -911,18 +3572,31 @@ namespace lazy_html
     return values;
   }
 
+  std::vector<fine::Term> attribute(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                                    ErlNifBinary name)
+  {
+    auto call = NifCall(NifId::ATTRIBUTE);
+    call.add_nodes(ex_lazy_html.resource->nodes.size());
+
+    return nodes_attribute(env, ex_lazy_html.resource->nodes, name);
+  }
+
   FINE_NIF(attribute, 0);
 
   std::vector<fine::Term> attributes(ErlNifEnv *env, ExLazyHTML ex_lazy_html)
   {
+    auto call = NifCall(NifId::ATTRIBUTES);
+    call.add_nodes(ex_lazy_html.resource->nodes.size());
+
     auto list = std::vector<fine::Term>();
+    auto encoder = ElementEncoder(ex_lazy_html.resource);
 
     for (auto node : ex_lazy_html.resource->nodes)
     {
       if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
       {
         auto element = lxb_dom_interface_element(node);
-        list.push_back(attributes_to_term(env, element, false));
+        list.push_back(encoder.attributes(env, element, false));
       }
     }
 
@@ -931,15 +3605,29 @@ namespace lazy_html
 
   FINE_NIF(attributes, 0);
 
+  // Returns up to length root nodes starting at offset, each as a
+  // separate LazyHTML.
   std::tuple<std::vector<ExLazyHTML>, bool> nodes(ErlNifEnv *env,
-                                                  ExLazyHTML ex_lazy_html)
+                                                  ExLazyHTML ex_lazy_html,
+                                                  uint64_t offset,
+                                                  uint64_t length)
   {
+    auto call = NifCall(NifId::NODES);
+    auto &all_nodes = ex_lazy_html.resource->nodes;
+
+    auto start = std::min(static_cast<size_t>(offset), all_nodes.size());
+    auto end = start + std::min(static_cast<size_t>(length),
+                                all_nodes.size() - start);
+
     auto list = std::vector<ExLazyHTML>();
+    list.reserve(end - start);
+    call.add_nodes(end - start);
 
-    for (auto node : ex_lazy_html.resource->nodes)
+    for (auto i = start; i < end; i++)
     {
       list.push_back(ExLazyHTML(fine::make_resource<LazyHTML>(
-          ex_lazy_html.resource->document_ref, std::vector({node}), true)));
+          ex_lazy_html.resource->document_ref,
+          std::vector({all_nodes[i]}), true)));
     }
 
     return std::make_tuple(list, ex_lazy_html.resource->from_selector);
@@ -956,29 +3644,199 @@ namespace lazy_html
 
   std::vector<fine::Term> tag(ErlNifEnv *env, ExLazyHTML ex_lazy_html)
   {
+    auto call = NifCall(NifId::TAG);
+    call.add_nodes(ex_lazy_html.resource->nodes.size());
+
     auto values = std::vector<fine::Term>();
+    auto encoder = ElementEncoder(ex_lazy_html.resource);
 
     for (auto node : ex_lazy_html.resource->nodes)
     {
       if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
       {
         auto element = lxb_dom_interface_element(node);
+        values.push_back(encoder.name(env, element));
+      }
+    }
 
-        size_t name_length;
-        auto name = lxb_dom_element_qualified_name(element, &name_length);
-        if (name == NULL)
+    return values;
+  }
+
+  FINE_NIF(tag, 0);
+
+  // A field of an extraction spec, given as {selector, extractor, arg},
+  // where arg is only used by the :attr extractor.
+  using ExtractField = std::tuple<SelectorArg, fine::Atom, ErlNifBinary>;
+
+  // Evaluates all fields against the given roots. This is equivalent to
+  // calling query followed by the given extractor, but without creating
+  // the intermediate resources.
+  std::vector<fine::Term>
+  extract_fields(ErlNifEnv *env, LazyHTML &lazy_html,
+                 const std::vector<lxb_dom_node_t *> &roots,
+                 const std::vector<std::shared_ptr<SelectorList>> &selector_lists,
+                 const std::vector<ExtractField> &fields, NifCall &call)
+  {
+    auto values = std::vector<fine::Term>();
+
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+      const auto &[css_selector, extractor, arg] = fields[i];
+
+      auto nodes =
+          query_nodes(*lazy_html.document_ref, roots, *selector_lists[i]);
+      call.add_nodes(nodes.size());
+
+      if (extractor == atoms::text)
+      {
+        values.push_back(nodes_text(env, nodes, TextOptions()));
+      }
+      else if (extractor == atoms::attr)
+      {
+        values.push_back(fine::encode(env, nodes_attribute(env, nodes, arg)));
+      }
+      else if (extractor == atoms::html)
+      {
+        auto serializer = HtmlSerializer<BinaryBuffer>(nodes, false);
+        while (!serializer.run(SIZE_MAX))
         {
-          throw std::runtime_error("failed to read tag name");
         }
-        auto name_term = make_new_binary(env, name_length, name);
-        values.push_back(name_term);
+        values.push_back(serializer.html.make_term(env));
+      }
+      else if (extractor == atoms::count)
+      {
+        values.push_back(
+            fine::encode(env, static_cast<uint64_t>(nodes.size())));
+      }
+      else
+      {
+        throw std::invalid_argument("unexpected extractor: :" +
+                                    extractor.to_string());
       }
     }
 
     return values;
   }
 
-  FINE_NIF(tag, 0);
+  std::vector<std::vector<fine::Term>>
+  extract(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+          std::optional<SelectorArg> item_selector,
+          std::vector<ExtractField> fields)
+  {
+    auto call = NifCall(NifId::EXTRACT);
+    auto &lazy_html = *ex_lazy_html.resource;
+
+    auto selector_lists = std::vector<std::shared_ptr<SelectorList>>();
+    for (auto &field : fields)
+    {
+      selector_lists.push_back(get_selector_list(std::get<0>(field)));
+    }
+
+    auto rows = std::vector<std::vector<fine::Term>>();
+
+    if (!item_selector)
+    {
+      rows.push_back(extract_fields(env, lazy_html, lazy_html.nodes,
+                                    selector_lists, fields, call));
+      return rows;
+    }
+
+    auto item_selector_list = get_selector_list(*item_selector);
+    auto items = query_nodes(*lazy_html.document_ref, lazy_html.nodes,
+                             *item_selector_list);
+
+    for (auto item : items)
+    {
+      rows.push_back(extract_fields(env, lazy_html, {item}, selector_lists,
+                                    fields, call));
+    }
+
+    return rows;
+  }
+
+  FINE_NIF(extract, ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+  // A modification, given as {operation, selector, arg1, arg2}. When
+  // selector is nil, the operation applies to the root nodes, otherwise
+  // to the elements matching it within the root nodes. Unused arguments
+  // are empty binaries.
+  using Modification = std::tuple<fine::Atom, std::optional<SelectorArg>,
+                                  ErlNifBinary, ErlNifBinary>;
+
+  // Applies all modifications, in order, to a single copy of the
+  // document, so a sequence of modifications copies the document once.
+  ExLazyHTML modify(ErlNifEnv *env, ExLazyHTML ex_lazy_html,
+                    std::vector<Modification> modifications)
+  {
+    auto call = NifCall(NifId::MODIFY);
+
+    // Selectors are resolved before copying, so that invalid ones fail
+    // early.
+    auto selector_lists = std::vector<std::shared_ptr<SelectorList>>();
+    for (auto &[operation, css_selector, arg1, arg2] : modifications)
+    {
+      call.add_bytes_in(arg1.size + arg2.size);
+      selector_lists.push_back(
+          css_selector ? get_selector_list(*css_selector) : nullptr);
+    }
+
+    return modify_copy(call, ex_lazy_html,
+                       [&](lxb_html_document_t *document,
+                           const std::vector<lxb_dom_node_t *> &roots)
+                       {
+      auto matches = std::vector<lxb_dom_node_t *>();
+
+      for (size_t i = 0; i < modifications.size(); i++)
+      {
+        const auto &[operation, css_selector, arg1, arg2] = modifications[i];
+
+        auto nodes = &roots;
+        if (selector_lists[i])
+        {
+          // The copy has no index yet, so we walk the subtrees.
+          matches.clear();
+          query_roots(NULL, NULL, roots, 0, roots.size(), *selector_lists[i],
+                      matches);
+          call.add_nodes(matches.size());
+          nodes = &matches;
+        }
+
+        for (auto node : *nodes)
+        {
+          if (operation == atoms::set_attribute)
+          {
+            set_node_attribute(node, arg1, arg2);
+          }
+          else if (operation == atoms::remove_attribute)
+          {
+            remove_node_attribute(node, arg1);
+          }
+          else if (operation == atoms::remove)
+          {
+            remove_node(node);
+          }
+          else if (operation == atoms::replace_with_html)
+          {
+            replace_node_with_html(document, node, arg1);
+          }
+          else if (operation == atoms::append_html)
+          {
+            append_node_html(document, node, arg1);
+          }
+          else if (operation == atoms::set_text)
+          {
+            set_node_text(document, node, arg1);
+          }
+          else
+          {
+            throw std::invalid_argument("unexpected operation: :" +
+                                        operation.to_string());
+          }
+        }
+      } });
+  }
+
+  FINE_NIF(modify, ERL_NIF_DIRTY_JOB_CPU_BOUND);
 
 } // namespace lazy_html
 
@@ -0,0 +1,171 @@
+// Training driver for profile-guided builds, see LAZY_HTML_PGO in the
+// Makefile.
+//
+// It runs the workloads that dominate NIF calls, that is parsing,
+// selector matching, serialization and text extraction, over the
+// documents given as arguments. It links only lexbor and the code in
+// tree.hpp, so it runs without the VM.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <lexbor/html/html.h>
+
+#include "tree.hpp"
+
+namespace
+{
+  const int iterations = 20;
+
+  const char *selectors[] = {
+      "a",
+      ".item",
+      "div > p",
+      "ul li:first-child a[href]",
+      "table tr:nth-child(2n) td.c1",
+      "[data-value]",
+      "h1, h2, h3",
+      "section:not(.hidden) p em",
+  };
+
+  void check(lxb_status_t status, const char *message)
+  {
+    if (status != LXB_STATUS_OK)
+    {
+      fprintf(stderr, "%s\n", message);
+      exit(1);
+    }
+  }
+
+  lxb_status_t count_node(lxb_dom_node_t *node,
+                          lxb_css_selector_specificity_t spec, void *ctx)
+  {
+    (*static_cast<size_t *>(ctx))++;
+    return LXB_STATUS_OK;
+  }
+
+  size_t train(const std::string &html, lxb_selectors_t *selectors_engine,
+               const std::vector<lxb_css_selector_list_t *> &selector_lists)
+  {
+    auto document = lxb_html_document_create();
+    if (document == NULL)
+    {
+      fprintf(stderr, "failed to create document\n");
+      exit(1);
+    }
+
+    check(lxb_html_document_parse(
+              document, reinterpret_cast<const lxb_char_t *>(html.data()),
+              html.size()),
+          "failed to parse document");
+
+    auto roots = std::vector<lxb_dom_node_t *>();
+    for (auto node = lxb_dom_node_first_child(lxb_dom_interface_node(document));
+         node != NULL; node = lxb_dom_node_next(node))
+    {
+      roots.push_back(node);
+    }
+
+    size_t result = 0;
+
+    for (auto selector_list : selector_lists)
+    {
+      for (auto root : roots)
+      {
+        check(lxb_selectors_find(selectors_engine, root, selector_list,
+                                 count_node, &result),
+              "failed to run find");
+        lxb_selectors_clean(selectors_engine);
+      }
+    }
+
+    for (auto skip_whitespace_nodes : {false, true})
+    {
+      auto serializer =
+          lazy_html::HtmlSerializer<std::string>(roots, skip_whitespace_nodes);
+      serializer.run(SIZE_MAX);
+      result += serializer.html.size();
+    }
+
+    auto visible_options = lazy_html::TextOptions();
+    visible_options.visible_only = true;
+    visible_options.block_separator = "\n";
+    visible_options.collapse_whitespace = true;
+
+    for (auto options : {lazy_html::TextOptions(), visible_options})
+    {
+      auto text = std::string();
+      auto writer = lazy_html::TextWriter<std::string>(text, options);
+      writer.write(roots);
+      result += text.size();
+    }
+
+    lxb_html_document_destroy(document);
+
+    return result;
+  }
+} // namespace
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s file.html ...\n", argv[0]);
+    return 1;
+  }
+
+  auto parser = lxb_css_parser_create();
+  check(lxb_css_parser_init(parser, NULL), "failed to create css parser");
+
+  auto selectors_engine = lxb_selectors_create();
+  check(lxb_selectors_init(selectors_engine), "failed to create selectors");
+  lxb_selectors_opt_set(selectors_engine,
+                        static_cast<lxb_selectors_opt_t>(
+                            LXB_SELECTORS_OPT_MATCH_FIRST |
+                            LXB_SELECTORS_OPT_MATCH_ROOT));
+
+  auto selector_lists = std::vector<lxb_css_selector_list_t *>();
+  for (auto selector : selectors)
+  {
+    auto list = lxb_css_selectors_parse(
+        parser, reinterpret_cast<const lxb_char_t *>(selector),
+        strlen(selector));
+    check(parser->status, "failed to parse css selector");
+    selector_lists.push_back(list);
+  }
+
+  size_t result = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    auto file = std::ifstream(argv[i], std::ios::binary);
+    if (!file)
+    {
+      fprintf(stderr, "failed to read %s\n", argv[i]);
+      return 1;
+    }
+    auto html = std::string(std::istreambuf_iterator<char>(file),
+                            std::istreambuf_iterator<char>());
+
+    for (int j = 0; j < iterations; j++)
+    {
+      result += train(html, selectors_engine, selector_lists);
+    }
+  }
+
+  for (auto list : selector_lists)
+  {
+    lxb_css_selector_list_destroy_memory(list);
+  }
+  lxb_selectors_destroy(selectors_engine, true);
+  lxb_css_parser_destroy(parser, true);
+
+  printf("trained on %d documents (%zu)\n", argc - 1, result);
+
+  return 0;
+}
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LAZY_HTML_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define LAZY_HTML_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define LAZY_HTML_TARGET_AVX2
+#else
+#define LAZY_HTML_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Vectorized kernels for the byte scans on the serialization hot path.
+//
+// Each kernel has a scalar implementation and vectorized ones, which
+// process 16 or 32 bytes at a time and fall back to the scalar code
+// for the tail. The best implementation supported by the CPU is picked
+// once, when the library is loaded.
+namespace lazy_html::simd
+{
+
+  inline bool is_escape_char(unsigned char ch)
+  {
+    return ch == '<' || ch == '>' || ch == '&' || ch == '"' || ch == '\'';
+  }
+
+  inline bool is_whitespace_char(unsigned char ch)
+  {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+  }
+
+  inline unsigned count_trailing_zeros(uint64_t value)
+  {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctzll(value));
+#endif
+  }
+
+  // Returns the index of the first character that needs escaping in
+  // HTML, or length if there is none.
+  inline size_t find_escape_char_scalar(const unsigned char *data,
+                                        size_t length)
+  {
+    for (size_t i = 0; i < length; i++)
+    {
+      if (is_escape_char(data[i]))
+      {
+        return i;
+      }
+    }
+
+    return length;
+  }
+
+  // Returns the index of the first character that is not whitespace,
+  // or length if there is none.
+  inline size_t find_non_whitespace_char_scalar(const unsigned char *data,
+                                                size_t length)
+  {
+    for (size_t i = 0; i < length; i++)
+    {
+      if (!is_whitespace_char(data[i]))
+      {
+        return i;
+      }
+    }
+
+    return length;
+  }
+
+#ifdef LAZY_HTML_SIMD_X86
+
+  inline size_t find_escape_char_sse2(const unsigned char *data,
+                                      size_t length)
+  {
+    auto lt = _mm_set1_epi8('<');
+    auto gt = _mm_set1_epi8('>');
+    auto amp = _mm_set1_epi8('&');
+    auto quot = _mm_set1_epi8('"');
+    auto apos = _mm_set1_epi8('\'');
+
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+      auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+      auto matches = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, lt), _mm_cmpeq_epi8(chunk, gt)),
+          _mm_or_si128(
+              _mm_or_si128(_mm_cmpeq_epi8(chunk, amp),
+                           _mm_cmpeq_epi8(chunk, quot)),
+              _mm_cmpeq_epi8(chunk, apos)));
+      auto mask = static_cast<uint32_t>(_mm_movemask_epi8(matches));
+      if (mask != 0)
+      {
+        return i + count_trailing_zeros(mask);
+      }
+    }
+
+    return i + find_escape_char_scalar(data + i, length - i);
+  }
+
+  inline size_t find_non_whitespace_char_sse2(const unsigned char *data,
+                                              size_t length)
+  {
+    auto space = _mm_set1_epi8(' ');
+    auto tab = _mm_set1_epi8('\t');
+    auto lf = _mm_set1_epi8('\n');
+    auto cr = _mm_set1_epi8('\r');
+
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+      auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+      auto matches = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)),
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, lf), _mm_cmpeq_epi8(chunk, cr)));
+      auto mask = ~static_cast<uint32_t>(_mm_movemask_epi8(matches)) & 0xFFFF;
+      if (mask != 0)
+      {
+        return i + count_trailing_zeros(mask);
+      }
+    }
+
+    return i + find_non_whitespace_char_scalar(data + i, length - i);
+  }
+
+  LAZY_HTML_TARGET_AVX2 inline size_t
+  find_escape_char_avx2(const unsigned char *data, size_t length)
+  {
+    auto lt = _mm256_set1_epi8('<');
+    auto gt = _mm256_set1_epi8('>');
+    auto amp = _mm256_set1_epi8('&');
+    auto quot = _mm256_set1_epi8('"');
+    auto apos = _mm256_set1_epi8('\'');
+
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+      auto chunk =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+      auto matches = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(chunk, lt),
+                          _mm256_cmpeq_epi8(chunk, gt)),
+          _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, amp),
+                                          _mm256_cmpeq_epi8(chunk, quot)),
+                          _mm256_cmpeq_epi8(chunk, apos)));
+      auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(matches));
+      if (mask != 0)
+      {
+        return i + count_trailing_zeros(mask);
+      }
+    }
+
+    return i + find_escape_char_sse2(data + i, length - i);
+  }
+
+  LAZY_HTML_TARGET_AVX2 inline size_t
+  find_non_whitespace_char_avx2(const unsigned char *data, size_t length)
+  {
+    auto space = _mm256_set1_epi8(' ');
+    auto tab = _mm256_set1_epi8('\t');
+    auto lf = _mm256_set1_epi8('\n');
+    auto cr = _mm256_set1_epi8('\r');
+
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+      auto chunk =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+      auto matches = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                          _mm256_cmpeq_epi8(chunk, tab)),
+          _mm256_or_si256(_mm256_cmpeq_epi8(chunk, lf),
+                          _mm256_cmpeq_epi8(chunk, cr)));
+      auto mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(matches));
+      if (mask != 0)
+      {
+        return i + count_trailing_zeros(mask);
+      }
+    }
+
+    return i + find_non_whitespace_char_sse2(data + i, length - i);
+  }
+
+  inline bool cpu_supports_avx2()
+  {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    auto osxsave = (info[2] & (1 << 27)) != 0;
+    auto avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+    {
+      return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+  }
+
+#endif
+
+#ifdef LAZY_HTML_SIMD_NEON
+
+  // NEON has no movemask, so we narrow the comparison result to 4 bits
+  // per byte and look for the first set nibble.
+  inline uint64_t neon_mask(uint8x16_t matches)
+  {
+    auto narrowed = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+  }
+
+  inline size_t find_escape_char_neon(const unsigned char *data,
+                                      size_t length)
+  {
+    auto lt = vdupq_n_u8('<');
+    auto gt = vdupq_n_u8('>');
+    auto amp = vdupq_n_u8('&');
+    auto quot = vdupq_n_u8('"');
+    auto apos = vdupq_n_u8('\'');
+
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+      auto chunk = vld1q_u8(data + i);
+      auto matches = vorrq_u8(
+          vorrq_u8(vceqq_u8(chunk, lt), vceqq_u8(chunk, gt)),
+          vorrq_u8(vorrq_u8(vceqq_u8(chunk, amp), vceqq_u8(chunk, quot)),
+                   vceqq_u8(chunk, apos)));
+      auto mask = neon_mask(matches);
+      if (mask != 0)
+      {
+        return i + count_trailing_zeros(mask) / 4;
+      }
+    }
+
+    return i + find_escape_char_scalar(data + i, length - i);
+  }
+
+  inline size_t find_non_whitespace_char_neon(const unsigned char *data,
+                                              size_t length)
+  {
+    auto space = vdupq_n_u8(' ');
+    auto tab = vdupq_n_u8('\t');
+    auto lf = vdupq_n_u8('\n');
+    auto cr = vdupq_n_u8('\r');
+
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+      auto chunk = vld1q_u8(data + i);
+      auto matches =
+          vorrq_u8(vorrq_u8(vceqq_u8(chunk, space), vceqq_u8(chunk, tab)),
+                   vorrq_u8(vceqq_u8(chunk, lf), vceqq_u8(chunk, cr)));
+      auto mask = neon_mask(vmvnq_u8(matches));
+      if (mask != 0)
+      {
+        return i + count_trailing_zeros(mask) / 4;
+      }
+    }
+
+    return i + find_non_whitespace_char_scalar(data + i, length - i);
+  }
+
+#endif
+
+  struct Kernels
+  {
+    size_t (*find_escape_char)(const unsigned char *data, size_t length);
+    size_t (*find_non_whitespace_char)(const unsigned char *data,
+                                       size_t length);
+  };
+
+  inline Kernels scalar_kernels()
+  {
+    return Kernels{find_escape_char_scalar, find_non_whitespace_char_scalar};
+  }
+
+  inline Kernels detect_kernels()
+  {
+#if defined(LAZY_HTML_SIMD_X86)
+    if (cpu_supports_avx2())
+    {
+      return Kernels{find_escape_char_avx2, find_non_whitespace_char_avx2};
+    }
+    // SSE2 is part of the x86-64 baseline.
+    return Kernels{find_escape_char_sse2, find_non_whitespace_char_sse2};
+#elif defined(LAZY_HTML_SIMD_NEON)
+    // NEON is part of the AArch64 baseline.
+    return Kernels{find_escape_char_neon, find_non_whitespace_char_neon};
+#else
+    return scalar_kernels();
+#endif
+  }
+
+  inline const Kernels kernels = detect_kernels();
+
+  inline size_t find_escape_char(const unsigned char *data, size_t length)
+  {
+    return kernels.find_escape_char(data, length);
+  }
+
+  inline size_t find_non_whitespace_char(const unsigned char *data,
+                                         size_t length)
+  {
+    return kernels.find_non_whitespace_char(data, length);
+  }
+
+} // namespace lazy_html::simd
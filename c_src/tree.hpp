@@ -0,0 +1,765 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <lexbor/html/html.h>
+
+#include "simd.hpp"
+
+// Tree traversal and serialization.
+//
+// This code depends only on lexbor and works with any output buffer
+// that has append(data, size) and append(string), so that it can be
+// benchmarked without the VM, see bench/native.
+namespace lazy_html
+{
+
+  inline lxb_dom_node_t *template_aware_first_child(lxb_dom_node_t *node)
+  {
+    if (lxb_html_tree_node_is(node, LXB_TAG_TEMPLATE))
+    {
+      // <template> elements don't have direct children, instead they hold
+      // a document fragment node, so we reach for its first child instead.
+      return lxb_html_interface_template(node)->content->node.first_child;
+    }
+    else
+    {
+      return lxb_dom_node_first_child(node);
+    }
+  }
+
+  // Visits all nodes in the given subtrees in document order. This is
+  // the single traversal used for all tree walks.
+  //
+  // For every node there is an ENTER event and for every element there
+  // is an additional LEAVE event, once all of its children have been
+  // visited. Instead of recursion, the walker keeps an explicit stack of
+  // the open elements, which means that the traversal can be suspended
+  // between any two events and resumed later, possibly in a different
+  // NIF call.
+  class TreeWalker
+  {
+  public:
+    enum Event
+    {
+      ENTER,
+      LEAVE
+    };
+
+    // By default the walker visits <template> contents, as if they were
+    // regular children. Set template_aware to false to visit only the
+    // actual children, the same as lxb_selectors_find does.
+    TreeWalker(std::vector<lxb_dom_node_t *> roots, bool template_aware = true)
+        : roots(roots), template_aware(template_aware) {}
+
+    // Moves to the next event. Returns false once all roots have been
+    // visited.
+    bool next()
+    {
+      if (this->descend)
+      {
+        this->descend = false;
+
+        auto child = this->template_aware
+                         ? template_aware_first_child(this->current)
+                         : lxb_dom_node_first_child(this->current);
+        if (child != NULL)
+        {
+          return this->enter(child);
+        }
+
+        this->stack.pop_back();
+        this->current_event = LEAVE;
+        return true;
+      }
+
+      if (this->stack.empty())
+      {
+        if (this->root_index < this->roots.size())
+        {
+          return this->enter(this->roots[this->root_index++]);
+        }
+
+        return false;
+      }
+
+      auto sibling = lxb_dom_node_next(this->current);
+      if (sibling != NULL)
+      {
+        return this->enter(sibling);
+      }
+
+      this->current = this->stack.back();
+      this->stack.pop_back();
+      this->current_event = LEAVE;
+      return true;
+    }
+
+    // Skips the children of the element that was just entered. There
+    // is no LEAVE event for that element.
+    void skip_children()
+    {
+      if (this->descend)
+      {
+        this->descend = false;
+        this->stack.pop_back();
+      }
+    }
+
+    lxb_dom_node_t *node() { return this->current; }
+
+    Event event() { return this->current_event; }
+
+    // The number of elements entered, but not yet left.
+    size_t depth() { return this->stack.size(); }
+
+    // The number of nodes entered so far.
+    size_t visited() { return this->num_visited; }
+
+  private:
+    std::vector<lxb_dom_node_t *> roots;
+    bool template_aware;
+    size_t root_index = 0;
+    std::vector<lxb_dom_node_t *> stack;
+    lxb_dom_node_t *current = NULL;
+    Event current_event = ENTER;
+    bool descend = false;
+    size_t num_visited = 0;
+
+    bool enter(lxb_dom_node_t *node)
+    {
+      this->current = node;
+      this->current_event = ENTER;
+      this->num_visited++;
+
+      if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+      {
+        this->stack.push_back(node);
+        this->descend = true;
+      }
+
+      return true;
+    }
+  };
+
+  // Appends data to html, replacing characters that need escaping with
+  // entities. The first unescaped_prefix_size bytes are known not to
+  // need escaping. Runs without such characters are located with the
+  // vectorized kernel and appended at once.
+  template <typename Buffer>
+  void append_escaping(Buffer &html, const unsigned char *data,
+                       size_t length, size_t unescaped_prefix_size = 0,
+                       const simd::Kernels &kernels = simd::kernels)
+  {
+    size_t offset = 0;
+    size_t i = unescaped_prefix_size;
+
+    while (true)
+    {
+      i += kernels.find_escape_char(data + i, length - i);
+
+      if (i == length)
+      {
+        break;
+      }
+
+      if (i > offset)
+      {
+        html.append(reinterpret_cast<const char *>(data + offset), i - offset);
+      }
+
+      switch (data[i])
+      {
+      case '<':
+        html.append("&lt;");
+        break;
+      case '>':
+        html.append("&gt;");
+        break;
+      case '&':
+        html.append("&amp;");
+        break;
+      case '"':
+        html.append("&quot;");
+        break;
+      case '\'':
+        html.append("&#39;");
+        break;
+      }
+
+      i++;
+      offset = i;
+    }
+
+    if (length > offset)
+    {
+      html.append(reinterpret_cast<const char *>(data + offset),
+                  length - offset);
+    }
+  }
+
+  inline bool is_noescape_text_node(lxb_dom_node_t *node)
+  {
+    if (node->parent != NULL)
+    {
+      switch (node->parent->local_name)
+      {
+      case LXB_TAG_STYLE:
+      case LXB_TAG_SCRIPT:
+      case LXB_TAG_XMP:
+      case LXB_TAG_IFRAME:
+      case LXB_TAG_NOEMBED:
+      case LXB_TAG_NOFRAMES:
+      case LXB_TAG_PLAINTEXT:
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  inline size_t
+  leading_whitespace_size(const unsigned char *data, size_t length,
+                          const simd::Kernels &kernels = simd::kernels)
+  {
+    return kernels.find_non_whitespace_char(data, length);
+  }
+
+  // Serialized HTML of subtrees, keyed by the subtree root and the
+  // serializer options, see HtmlSerializer::set_cache.
+  //
+  // The cache holds at most max_bytes of HTML and evicts the least
+  // recently used entries first. Entries are handed out as shared
+  // pointers, so they remain valid after eviction.
+  class SubtreeCache
+  {
+  public:
+    SubtreeCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    std::shared_ptr<const std::string> get(lxb_dom_node_t *node,
+                                           bool skip_whitespace_nodes)
+    {
+      auto lock = std::lock_guard<std::mutex>(this->mutex);
+
+      auto it = this->index.find(Key{node, skip_whitespace_nodes});
+      if (it == this->index.end())
+      {
+        return nullptr;
+      }
+
+      this->entries.splice(this->entries.begin(), this->entries, it->second);
+      return it->second->html;
+    }
+
+    void put(lxb_dom_node_t *node, bool skip_whitespace_nodes,
+             std::string html)
+    {
+      if (html.size() > this->max_bytes)
+      {
+        return;
+      }
+
+      auto lock = std::lock_guard<std::mutex>(this->mutex);
+
+      auto key = Key{node, skip_whitespace_nodes};
+      if (this->index.count(key) > 0)
+      {
+        // Serialized concurrently by another call.
+        return;
+      }
+
+      this->bytes += html.size();
+      this->entries.push_front(
+          Entry{key, std::make_shared<const std::string>(std::move(html))});
+      this->index[key] = this->entries.begin();
+
+      while (this->bytes > this->max_bytes)
+      {
+        auto &last = this->entries.back();
+        this->bytes -= last.html->size();
+        this->index.erase(last.key);
+        this->entries.pop_back();
+      }
+    }
+
+    // The largest entry accepted by put.
+    size_t max_size() const { return this->max_bytes; }
+
+    // The number of bytes of HTML held.
+    size_t size()
+    {
+      auto lock = std::lock_guard<std::mutex>(this->mutex);
+      return this->bytes;
+    }
+
+  private:
+    struct Key
+    {
+      lxb_dom_node_t *node;
+      bool skip_whitespace_nodes;
+
+      bool operator==(const Key &other) const
+      {
+        return this->node == other.node &&
+               this->skip_whitespace_nodes == other.skip_whitespace_nodes;
+      }
+    };
+
+    struct KeyHash
+    {
+      size_t operator()(const Key &key) const
+      {
+        return std::hash<lxb_dom_node_t *>()(key.node) ^
+               static_cast<size_t>(key.skip_whitespace_nodes);
+      }
+    };
+
+    struct Entry
+    {
+      Key key;
+      std::shared_ptr<const std::string> html;
+    };
+
+    std::mutex mutex;
+    size_t max_bytes;
+    size_t bytes = 0;
+    // Most recently used first.
+    std::list<Entry> entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+  };
+
+  template <typename Buffer>
+  class HtmlSerializer
+  {
+  public:
+    HtmlSerializer(std::vector<lxb_dom_node_t *> roots,
+                   bool skip_whitespace_nodes, Buffer html = Buffer())
+        : html(std::move(html)), walker(roots),
+          skip_whitespace_nodes(skip_whitespace_nodes) {}
+
+    // Serializes up to max_nodes nodes. Returns true once done.
+    bool run(size_t max_nodes)
+    {
+      for (size_t i = 0; i < max_nodes; i++)
+      {
+        if (!this->walker.next())
+        {
+          return true;
+        }
+
+        // Text and comments directly within a root element are at depth
+        // 1 too, so we check the node type.
+        if (this->cache != NULL && this->walker.depth() == 1 &&
+            this->walker.event() == TreeWalker::ENTER &&
+            this->walker.node()->type == LXB_DOM_NODE_TYPE_ELEMENT &&
+            !this->recording && !this->recording_abandoned)
+        {
+          // Entered a root element.
+          auto node = this->walker.node();
+
+          if (auto cached = this->cache->get(node, this->skip_whitespace_nodes))
+          {
+            this->html.append(cached->data(), cached->size());
+            this->walker.skip_children();
+            continue;
+          }
+
+          if (this->record)
+          {
+            this->recording.emplace();
+          }
+        }
+
+        if (this->recording)
+        {
+          this->append_event(*this->recording);
+
+          if (this->recording->size() > this->cache->max_size())
+          {
+            // The root element would not fit in the cache anyway, so we
+            // stop recording and write the rest directly to the output.
+            this->html.append(this->recording->data(), this->recording->size());
+            this->recording.reset();
+            // Nothing is looked up or recorded until the root element
+            // is left.
+            this->recording_abandoned = this->walker.depth() > 0;
+          }
+          else if (this->walker.depth() == 0)
+          {
+            // Left the root element, either with a LEAVE event or by
+            // skipping the children of a void element.
+            this->html.append(this->recording->data(), this->recording->size());
+            this->cache->put(this->walker.node(), this->skip_whitespace_nodes,
+                             std::move(*this->recording));
+            this->recording.reset();
+          }
+        }
+        else
+        {
+          this->append_event(this->html);
+
+          if (this->recording_abandoned && this->walker.depth() == 0)
+          {
+            this->recording_abandoned = false;
+          }
+        }
+      }
+
+      return false;
+    }
+
+    // Reuses the HTML of root elements from the given cache when
+    // available. Unless record is false, the HTML of the other root
+    // elements is memoized in the cache. Recording holds back the
+    // output of a root element until it is left, so it should be
+    // disabled when the output is consumed incrementally. The cache
+    // must outlive the serializer.
+    void set_cache(SubtreeCache *cache, bool record = true)
+    {
+      this->cache = cache;
+      this->record = record;
+    }
+
+    size_t nodes_visited() { return this->walker.visited(); }
+
+    Buffer html;
+
+  private:
+    TreeWalker walker;
+    bool skip_whitespace_nodes;
+    SubtreeCache *cache = NULL;
+    bool record = false;
+    // The HTML of the root element being memoized.
+    std::optional<std::string> recording;
+    // Whether the recording of the current root element was stopped,
+    // because it exceeded the cache size.
+    bool recording_abandoned = false;
+
+    template <typename Output>
+    void append_event(Output &html)
+    {
+      auto node = this->walker.node();
+
+      if (this->walker.event() == TreeWalker::LEAVE)
+      {
+        this->append_end_tag(html, node);
+      }
+      else if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+      {
+        this->append_start_tag(html, node);
+      }
+      else
+      {
+        this->append_leaf(html, node);
+      }
+    }
+
+    template <typename Output>
+    void append_start_tag(Output &html, lxb_dom_node_t *node)
+    {
+      auto element = lxb_dom_interface_element(node);
+      size_t name_length;
+      auto name = lxb_dom_element_qualified_name(element, &name_length);
+      if (name == NULL)
+      {
+        throw std::runtime_error("failed to read tag name");
+      }
+      html.append("<");
+      html.append(reinterpret_cast<const char *>(name), name_length);
+
+      for (auto attribute = lxb_dom_element_first_attribute(element);
+           attribute != NULL;
+           attribute = lxb_dom_element_next_attribute(attribute))
+      {
+        html.append(" ");
+
+        size_t name_length;
+        auto name = lxb_dom_attr_qualified_name(attribute, &name_length);
+        html.append(reinterpret_cast<const char *>(name), name_length);
+
+        html.append("=\"");
+
+        size_t value_length;
+        auto value = lxb_dom_attr_value(attribute, &value_length);
+        append_escaping(html, value, value_length);
+
+        html.append("\"");
+      }
+
+      if (lxb_html_node_is_void(node))
+      {
+        html.append("/>");
+        this->walker.skip_children();
+      }
+      else
+      {
+        html.append(">");
+      }
+    }
+
+    template <typename Output>
+    void append_end_tag(Output &html, lxb_dom_node_t *node)
+    {
+      size_t name_length;
+      auto name = lxb_dom_element_qualified_name(lxb_dom_interface_element(node),
+                                                 &name_length);
+      html.append("</");
+      html.append(reinterpret_cast<const char *>(name), name_length);
+      html.append(">");
+    }
+
+    template <typename Output>
+    void append_leaf(Output &html, lxb_dom_node_t *node)
+    {
+      if (node->type == LXB_DOM_NODE_TYPE_TEXT)
+      {
+        auto character_data = lxb_dom_interface_character_data(node);
+
+        auto whitespace_size = leading_whitespace_size(
+            character_data->data.data, character_data->data.length);
+
+        if (whitespace_size == character_data->data.length &&
+            this->skip_whitespace_nodes)
+        {
+          // Append nothing
+        }
+        else
+        {
+          if (is_noescape_text_node(node))
+          {
+            html.append(reinterpret_cast<char *>(character_data->data.data),
+                        character_data->data.length);
+          }
+          else
+          {
+            append_escaping(html, character_data->data.data,
+                            character_data->data.length, whitespace_size);
+          }
+        }
+      }
+      else if (node->type == LXB_DOM_NODE_TYPE_COMMENT)
+      {
+        auto character_data = lxb_dom_interface_character_data(node);
+        html.append("<!--");
+        html.append(reinterpret_cast<char *>(character_data->data.data),
+                    character_data->data.length);
+        html.append("-->");
+      }
+    }
+  };
+
+  struct TextOptions
+  {
+    // Skips the contents of elements that are never rendered.
+    bool visible_only = false;
+    // Written between the text of block-level elements.
+    std::optional<std::string_view> block_separator;
+    // Replaces runs of whitespace with a single space and drops
+    // whitespace at the start, at the end and around block separators.
+    bool collapse_whitespace = false;
+  };
+
+  inline bool is_hidden_element(lxb_dom_node_t *node)
+  {
+    switch (node->local_name)
+    {
+    case LXB_TAG_HEAD:
+    case LXB_TAG_SCRIPT:
+    case LXB_TAG_STYLE:
+    case LXB_TAG_NOSCRIPT:
+    case LXB_TAG_TEMPLATE:
+      return true;
+    }
+
+    return lxb_dom_element_has_attribute(
+        lxb_dom_interface_element(node),
+        reinterpret_cast<const lxb_char_t *>("hidden"), 6);
+  }
+
+  inline bool is_block_element(lxb_dom_node_t *node)
+  {
+    if (node->ns != LXB_NS_HTML)
+    {
+      return false;
+    }
+
+    switch (node->local_name)
+    {
+    case LXB_TAG_ADDRESS:
+    case LXB_TAG_ARTICLE:
+    case LXB_TAG_ASIDE:
+    case LXB_TAG_BLOCKQUOTE:
+    case LXB_TAG_BODY:
+    case LXB_TAG_BR:
+    case LXB_TAG_CAPTION:
+    case LXB_TAG_DD:
+    case LXB_TAG_DETAILS:
+    case LXB_TAG_DIALOG:
+    case LXB_TAG_DIV:
+    case LXB_TAG_DL:
+    case LXB_TAG_DT:
+    case LXB_TAG_FIELDSET:
+    case LXB_TAG_FIGCAPTION:
+    case LXB_TAG_FIGURE:
+    case LXB_TAG_FOOTER:
+    case LXB_TAG_FORM:
+    case LXB_TAG_H1:
+    case LXB_TAG_H2:
+    case LXB_TAG_H3:
+    case LXB_TAG_H4:
+    case LXB_TAG_H5:
+    case LXB_TAG_H6:
+    case LXB_TAG_HEADER:
+    case LXB_TAG_HGROUP:
+    case LXB_TAG_HR:
+    case LXB_TAG_LI:
+    case LXB_TAG_MAIN:
+    case LXB_TAG_NAV:
+    case LXB_TAG_OL:
+    case LXB_TAG_P:
+    case LXB_TAG_PRE:
+    case LXB_TAG_SECTION:
+    case LXB_TAG_SUMMARY:
+    case LXB_TAG_TABLE:
+    case LXB_TAG_TD:
+    case LXB_TAG_TH:
+    case LXB_TAG_TR:
+    case LXB_TAG_UL:
+      return true;
+    }
+
+    return false;
+  }
+
+  // Writes the text of the given nodes into the buffer, in a single
+  // walk. Separators and collapsed whitespace are held back until more
+  // text follows, so the result never starts or ends with them.
+  template <typename Buffer>
+  class TextWriter
+  {
+  public:
+    TextWriter(Buffer &buffer, const TextOptions &options)
+        : buffer(buffer), options(options) {}
+
+    void write(const std::vector<lxb_dom_node_t *> &nodes)
+    {
+      // Similarly to textContent, we do not include template contents.
+      auto walker = TreeWalker(nodes, false);
+
+      while (walker.next())
+      {
+        auto node = walker.node();
+
+        if (node->type == LXB_DOM_NODE_TYPE_TEXT)
+        {
+          auto character_data = lxb_dom_interface_character_data(node);
+          this->append(character_data->data.data, character_data->data.length);
+        }
+        else if (node->type == LXB_DOM_NODE_TYPE_ELEMENT)
+        {
+          if (walker.event() == TreeWalker::ENTER &&
+              this->options.visible_only && is_hidden_element(node))
+          {
+            walker.skip_children();
+            continue;
+          }
+
+          if (is_block_element(node))
+          {
+            this->break_block();
+          }
+        }
+      }
+
+      this->num_visited += walker.visited();
+    }
+
+    size_t nodes_visited() { return this->num_visited; }
+
+  private:
+    Buffer &buffer;
+    const TextOptions &options;
+    size_t num_visited = 0;
+    bool written = false;
+    bool pending_separator = false;
+    bool pending_space = false;
+
+    void break_block()
+    {
+      if (this->options.block_separator)
+      {
+        this->pending_separator = true;
+      }
+      else if (this->options.collapse_whitespace)
+      {
+        this->pending_space = true;
+      }
+    }
+
+    void append(const unsigned char *data, size_t length)
+    {
+      if (!this->options.collapse_whitespace)
+      {
+        if (length > 0)
+        {
+          this->write_chunk(data, length);
+        }
+        return;
+      }
+
+      size_t offset = 0;
+
+      while (offset < length)
+      {
+        auto whitespace_length =
+            simd::find_non_whitespace_char(data + offset, length - offset);
+        if (whitespace_length > 0)
+        {
+          this->pending_space = true;
+          offset += whitespace_length;
+          continue;
+        }
+
+        auto end = offset;
+        while (end < length && !simd::is_whitespace_char(data[end]))
+        {
+          end++;
+        }
+
+        this->write_chunk(data + offset, end - offset);
+        offset = end;
+      }
+    }
+
+    void write_chunk(const unsigned char *data, size_t length)
+    {
+      if (this->written)
+      {
+        if (this->pending_separator)
+        {
+          this->buffer.append(this->options.block_separator->data(),
+                              this->options.block_separator->size());
+        }
+        else if (this->pending_space)
+        {
+          this->buffer.append(" ", 1);
+        }
+      }
+
+      this->pending_separator = false;
+      this->pending_space = false;
+      this->written = true;
+      this->buffer.append(reinterpret_cast<const char *>(data), length);
+    }
+  };
+
+} // namespace lazy_html
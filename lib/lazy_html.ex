@@ -44,6 +44,76 @@ defmodule LazyHTML do
     LazyHTML.NIF.from_document(html)
   end
 
+  @doc """
+  Parses a batch of HTML documents.
+
+  Returns a list with `{:ok, lazy_html}` or `{:error, message}` for
+  each of the given documents, in the same order. A document failing
+  to parse does not affect the other ones.
+
+  The documents are parsed in a single native call, in parallel,
+  using a pool of worker threads. The pool size defaults to the number
+  of dirty CPU schedulers minus one, the calling scheduler being the
+  last thread, and can be changed in the application configuration:
+
+      config :lazy_html, :worker_pool_size, 4
+
+  The size is capped at the number of dirty CPU schedulers.
+
+  Parallel calls and the workers helping them share a budget of as
+  many threads as there are dirty CPU schedulers. When several dirty
+  schedulers run parallel calls at the same time, the calls get fewer
+  or no workers, so the number of busy threads stays within the
+  budget. In the worst case, when every dirty CPU scheduler runs a
+  parallel call, each call runs only on its own scheduler. Other dirty
+  NIFs running at the same time are not part of the budget.
+
+  ## Options
+
+    * `:parallel` - when `false`, the documents are parsed only on the
+      calling dirty scheduler. Defaults to `true`
+
+  ## Examples
+
+      iex> [{:ok, lazy_html1}, {:ok, lazy_html2}] =
+      ...>   LazyHTML.from_documents([~S|<p>Hello</p>|, ~S|<p>world!</p>|])
+      iex> LazyHTML.text(lazy_html1["p"])
+      "Hello"
+      iex> LazyHTML.text(lazy_html2["p"])
+      "world!"
+
+  """
+  @spec from_documents([String.t()], keyword()) :: [{:ok, t()} | {:error, String.t()}]
+  def from_documents(htmls, opts \\ []) when is_list(htmls) and is_list(opts) do
+    opts = Keyword.validate!(opts, parallel: true)
+    LazyHTML.NIF.from_documents(htmls, opts[:parallel])
+  end
+
+  @doc """
+  Parses an HTML document given as an enumerable of chunks.
+
+  This is useful when the document arrives in parts, for example as
+  a stream of HTTP response body chunks, since the chunks are parsed
+  as they come, without building the full binary first. See
+  `LazyHTML.Parser` for more control over the process.
+
+  ## Examples
+
+      iex> LazyHTML.from_stream(["<div>Hel", "lo world!</d", "iv>"])
+      #LazyHTML<
+        1 node
+        #1
+        <html><head></head><body><div>Hello world!</div></body></html>
+      >
+
+  """
+  @spec from_stream(Enumerable.t(String.t())) :: t()
+  def from_stream(chunks) do
+    chunks
+    |> Enum.reduce(LazyHTML.Parser.new(), &LazyHTML.Parser.feed(&2, &1))
+    |> LazyHTML.Parser.finish()
+  end
+
   @doc """
   Parses a segment of an HTML document.
 
@@ -85,6 +155,22 @@ defmodule LazyHTML do
       consist entirely of whitespace, usually whitespace between tags.
       Defaults to `false`.
 
+    * `:chunk_size` - when given, returns the HTML as a list of binaries
+      of this many bytes, the last one possibly shorter, instead of a
+      single binary. Large outputs are never copied into one contiguous
+      binary, which is convenient for writing to a socket or a file.
+      For producing the chunks lazily, see `to_html_stream/2`.
+
+    * `:memoize` - when `true`, caches the HTML of every element in
+      `lazy_html` on the document it belongs to, and reuses the cached
+      HTML on subsequent calls. This is useful when the same elements,
+      such as a shared navigation or footer, are serialized many times.
+      The cache holds at most 4 MiB per document, evicting the least
+      recently used entries, and it is freed together with the document,
+      see `memory/1`. Elements whose HTML exceeds the cache size are not
+      cached. With `:chunk_size`, cached HTML is reused, but nothing new
+      is cached, so that chunks are not held back. Defaults to `false`.
+
   ## Examples
 
       iex> lazy_html = LazyHTML.from_document(~S|<html><head></head><body>Hello world!</body></html>|)
@@ -105,12 +191,84 @@ defmodule LazyHTML do
       iex> LazyHTML.to_html(lazy_html, skip_whitespace_nodes: true)
       "<p><span> Hello </span><span> world </span></p>"
 
+      iex> lazy_html = LazyHTML.from_fragment(~S|<span>Hello</span>|)
+      iex> LazyHTML.to_html(lazy_html, chunk_size: 8)
+      ["<span>He", "llo</spa", "n>"]
+
   '''
-  @spec to_html(t(), keyword()) :: String.t()
+  @spec to_html(t(), keyword()) :: String.t() | [binary()]
   def to_html(%LazyHTML{} = lazy_html, opts \\ []) when is_list(opts) do
-    opts = Keyword.validate!(opts, skip_whitespace_nodes: false)
+    opts = Keyword.validate!(opts, skip_whitespace_nodes: false, chunk_size: nil, memoize: false)
+    validate_chunk_size!(opts[:chunk_size])
+
+    LazyHTML.NIF.to_html(
+      lazy_html,
+      opts[:skip_whitespace_nodes],
+      opts[:chunk_size],
+      opts[:memoize]
+    )
+  end
 
-    LazyHTML.NIF.to_html(lazy_html, opts[:skip_whitespace_nodes])
+  @doc ~S'''
+  Serializes `lazy_html` as a stream of HTML chunks.
+
+  The serialization resumes on every chunk requested, so the first
+  chunks are available right away and the full output is never held
+  in memory. This is useful for sending large documents, for example
+  with `Plug.Conn.chunk/2`.
+
+  The stream keeps the document alive until it is done.
+
+  ## Options
+
+    * `:skip_whitespace_nodes` and `:memoize` - same as in `to_html/2`.
+      As with `:chunk_size` there, `:memoize` only reuses cached HTML.
+
+    * `:chunk_size` - the size of the emitted binaries in bytes, only
+      the last one may be shorter. Defaults to `65536`.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<span>Hello</span>|)
+      iex> lazy_html |> LazyHTML.to_html_stream(chunk_size: 8) |> Enum.to_list()
+      ["<span>He", "llo</spa", "n>"]
+
+  '''
+  @spec to_html_stream(t(), keyword()) :: Enumerable.t(binary())
+  def to_html_stream(%LazyHTML{} = lazy_html, opts \\ []) when is_list(opts) do
+    opts =
+      Keyword.validate!(opts, skip_whitespace_nodes: false, chunk_size: 65_536, memoize: false)
+
+    validate_chunk_size!(opts[:chunk_size])
+
+    Stream.resource(
+      fn ->
+        LazyHTML.NIF.to_html_stream_new(
+          lazy_html,
+          opts[:skip_whitespace_nodes],
+          opts[:chunk_size],
+          opts[:memoize]
+        )
+      end,
+      fn
+        :done ->
+          {:halt, :done}
+
+        stream ->
+          case LazyHTML.NIF.to_html_stream_next(stream) do
+            {:cont, chunks} -> {chunks, stream}
+            {:done, chunks} -> {chunks, :done}
+          end
+      end,
+      fn _ -> :ok end
+    )
+  end
+
+  defp validate_chunk_size!(nil), do: :ok
+  defp validate_chunk_size!(size) when is_integer(size) and size > 0, do: :ok
+
+  defp validate_chunk_size!(other) do
+    raise ArgumentError, "expected :chunk_size to be a positive integer, got: #{inspect(other)}"
   end
 
   @doc """
@@ -144,6 +302,17 @@ defmodule LazyHTML do
       iex> LazyHTML.to_tree(lazy_html, sort_attributes: true)
       [{"div", [{"class", "layout"}, {"id", "root"}], []}]
 
+  ## Memory
+
+  To avoid copying, text, comments and attribute values longer than
+  64 bytes are returned as binaries that reference the document memory.
+  Shorter attribute values are copied, and so are the values returned
+  by `attributes/1` and `attribute/2`.
+  As long as any of them is alive, the whole document is kept in memory,
+  even if `lazy_html` itself is no longer used. When keeping a small
+  part of the tree around, copy the relevant strings with
+  `:binary.copy/1`.
+
   """
   @spec to_tree(t(), keyword()) :: LazyHTML.Tree.t()
   def to_tree(%LazyHTML{} = lazy_html, opts \\ []) when is_list(opts) do
@@ -256,12 +425,44 @@ defmodule LazyHTML do
 
   In the example above, each of the spans is first child of its
   respective parent, so the second query matches both.
+
+  The selector may also be precompiled with `LazyHTML.Selector.compile/1`.
   '''
-  @spec query(t(), String.t()) :: t()
-  def query(%LazyHTML{} = lazy_html, selector) when is_binary(selector) do
+  @spec query(t(), String.t() | LazyHTML.Selector.t()) :: t()
+  def query(%LazyHTML{} = lazy_html, selector)
+      when is_binary(selector) or is_struct(selector, LazyHTML.Selector) do
     LazyHTML.NIF.query(lazy_html, selector)
   end
 
+  @doc ~S'''
+  Runs `query/2` for each of the given selectors.
+
+  Returns a list of results, one per selector, in the same order. This
+  is equivalent to calling `query/2` for every selector, however the
+  document is traversed only once, which is considerably faster when
+  extracting multiple fields from the same document.
+
+  ## Examples
+
+      iex> lazy_html =
+      ...>   LazyHTML.from_fragment("""
+      ...>   <div class="product">
+      ...>     <h2>Hat</h2>
+      ...>     <span class="price">10</span>
+      ...>   </div>
+      ...>   """)
+      iex> [title, price] = LazyHTML.query_many(lazy_html, ["h2", ".price"])
+      iex> LazyHTML.text(title)
+      "Hat"
+      iex> LazyHTML.text(price)
+      "10"
+
+  '''
+  @spec query_many(t(), [String.t() | LazyHTML.Selector.t()]) :: [t()]
+  def query_many(%LazyHTML{} = lazy_html, selectors) when is_list(selectors) do
+    LazyHTML.NIF.query_many(lazy_html, selectors)
+  end
+
   @doc ~S'''
   Finds elements in `lazy_html` matching the given id.
 
@@ -302,6 +503,8 @@ defmodule LazyHTML do
   Filters `lazy_html` root nodes, keeping only elements that match
   the given CSS selector.
 
+  The selector may also be precompiled with `LazyHTML.Selector.compile/1`.
+
   ## Examples
 
       iex> lazy_html = LazyHTML.from_fragment("""
@@ -321,8 +524,9 @@ defmodule LazyHTML do
       >
 
   '''
-  @spec filter(t(), String.t()) :: t()
-  def filter(%LazyHTML{} = lazy_html, selector) when is_binary(selector) do
+  @spec filter(t(), String.t() | LazyHTML.Selector.t()) :: t()
+  def filter(%LazyHTML{} = lazy_html, selector)
+      when is_binary(selector) or is_struct(selector, LazyHTML.Selector) do
     LazyHTML.NIF.filter(lazy_html, selector)
   end
 
@@ -357,9 +561,26 @@ defmodule LazyHTML do
     LazyHTML.NIF.child_nodes(lazy_html)
   end
 
-  @doc """
+  @doc ~S'''
   Returns the text content of all nodes in `lazy_html`.
 
+  ## Options
+
+    * `:visible_only` - when `true`, ignores the contents of elements
+      that are not rendered, such as `<head>`, `<script>`, `<style>`
+      and `<noscript>`, as well as elements with the `hidden` attribute.
+      Defaults to `false`.
+
+    * `:block_separator` - a string inserted between the text of
+      block-level elements, such as paragraphs, list items and table
+      cells. The separator is never repeated and never added at the
+      start or at the end. Defaults to `nil`.
+
+    * `:collapse_whitespace` - when `true`, replaces every run of
+      whitespace with a single space and removes leading and trailing
+      whitespace. Without `:block_separator`, block boundaries also
+      count as whitespace. Defaults to `false`.
+
   ## Examples
 
       iex> lazy_html = LazyHTML.from_fragment(~S|<div><span>Hello</span> <span>world</span></div>|)
@@ -381,10 +602,43 @@ defmodule LazyHTML do
       iex> Enum.map(spans, &LazyHTML.text/1)
       ["Hello", "world"]
 
-  """
-  @spec text(t()) :: String.t()
-  def text(%LazyHTML{} = lazy_html) do
-    LazyHTML.NIF.text(lazy_html)
+  The options are useful to get readable text out of a whole page:
+
+      iex> lazy_html =
+      ...>   LazyHTML.from_document("""
+      ...>   <html>
+      ...>     <head><title>Page</title></head>
+      ...>     <body>
+      ...>       <h1>Title</h1>
+      ...>       <p>First   paragraph.</p>
+      ...>       <script>track();</script>
+      ...>       <ul><li>One</li><li>Two</li></ul>
+      ...>     </body>
+      ...>   </html>
+      ...>   """)
+      iex> LazyHTML.text(lazy_html,
+      ...>   visible_only: true,
+      ...>   block_separator: "\n",
+      ...>   collapse_whitespace: true
+      ...> )
+      "Title\nFirst paragraph.\nOne\nTwo"
+
+  '''
+  @spec text(t(), keyword()) :: String.t()
+  def text(%LazyHTML{} = lazy_html, opts \\ []) when is_list(opts) do
+    opts =
+      Keyword.validate!(opts,
+        visible_only: false,
+        block_separator: nil,
+        collapse_whitespace: false
+      )
+
+    LazyHTML.NIF.text(
+      lazy_html,
+      opts[:visible_only],
+      opts[:block_separator],
+      opts[:collapse_whitespace]
+    )
   end
 
   @doc ~S'''
@@ -480,10 +734,425 @@ defmodule LazyHTML do
     LazyHTML.NIF.tag(lazy_html)
   end
 
+  @doc ~S'''
+  Extracts multiple values from `lazy_html` in a single call.
+
+  The `spec` maps keys to `{selector, extractor}` tuples, where the
+  extractor is one of:
+
+    * `:text` - the text of the matching elements, as in `text/2`
+
+    * `{:attr, name}` - the values of the given attribute of the
+      matching elements, as in `attribute/2`
+
+    * `:html` - the matching elements serialized, as in `to_html/2`
+
+    * `:count` - the number of matching elements
+
+  Each field is therefore equivalent to `query/2` followed by the
+  given extractor, however all of them are evaluated at once, without
+  building intermediate `LazyHTML` structs.
+
+  Returns a map with the same keys as `spec`.
+
+  ## Options
+
+    * `:items` - a selector matching repeated records, such as list
+      entries or table rows. When given, `spec` is evaluated within
+      each of the matching elements and a list of maps is returned
+
+  ## Examples
+
+      iex> lazy_html =
+      ...>   LazyHTML.from_fragment("""
+      ...>   <div class="product">
+      ...>     <a href="/hat">Hat</a>
+      ...>     <span class="price">10</span>
+      ...>   </div>
+      ...>   <div class="product">
+      ...>     <a href="/scarf">Scarf</a>
+      ...>     <span class="price">20</span>
+      ...>   </div>
+      ...>   """)
+      iex> LazyHTML.extract(lazy_html, %{count: {".product", :count}})
+      %{count: 2}
+      iex> LazyHTML.extract(
+      ...>   lazy_html,
+      ...>   [name: {"a", :text}, link: {"a", {:attr, "href"}}, price: {".price", :html}],
+      ...>   items: ".product"
+      ...> )
+      [
+        %{name: "Hat", link: ["/hat"], price: ~S|<span class="price">10</span>|},
+        %{name: "Scarf", link: ["/scarf"], price: ~S|<span class="price">20</span>|}
+      ]
+
+  '''
+  @spec extract(t(), map() | keyword(), keyword()) :: map() | [map()]
+  def extract(%LazyHTML{} = lazy_html, spec, opts \\ [])
+      when (is_map(spec) or is_list(spec)) and is_list(opts) do
+    opts = Keyword.validate!(opts, items: nil)
+
+    {keys, fields} =
+      spec
+      |> Enum.map(fn
+        {key, {selector, extractor}} -> {key, extract_field(selector, extractor)}
+        other -> raise ArgumentError, "invalid extract spec entry: #{inspect(other)}"
+      end)
+      |> Enum.unzip()
+
+    rows = LazyHTML.NIF.extract(lazy_html, opts[:items], fields)
+
+    maps = Enum.map(rows, fn values -> keys |> Enum.zip(values) |> Map.new() end)
+
+    if opts[:items] do
+      maps
+    else
+      hd(maps)
+    end
+  end
+
+  defp extract_field(selector, extractor)
+       when is_binary(selector) or is_struct(selector, LazyHTML.Selector) do
+    case extractor do
+      extractor when extractor in [:text, :html, :count] -> {selector, extractor, ""}
+      {:attr, name} when is_binary(name) -> {selector, :attr, name}
+      other -> raise ArgumentError, "invalid extractor: #{inspect(other)}"
+    end
+  end
+
+  defp extract_field(selector, _extractor) do
+    raise ArgumentError, "invalid selector: #{inspect(selector)}"
+  end
+
+  @doc """
+  Copies the root nodes of `lazy_html`, along with their descendants,
+  into a new document.
+
+  The result of `query/2` and similar functions references the whole
+  document it comes from. When keeping a small part of a large page
+  around, for example in a cache, use this function, so that the
+  original document can be freed once no longer used.
+
+  If one root node is a descendant of another, it is copied separately,
+  and the copies are unrelated.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_document(~S|<div><p>Hello</p><p>world</p></div>|)
+      iex> paragraph = lazy_html |> LazyHTML.query("p:first-child") |> LazyHTML.detach()
+      #LazyHTML<
+        1 node (from selector)
+        #1
+        <p>Hello</p>
+      >
+      iex> LazyHTML.memory(paragraph) < LazyHTML.memory(lazy_html)
+      true
+
+  """
+  @spec detach(t()) :: t()
+  def detach(%LazyHTML{} = lazy_html) do
+    LazyHTML.NIF.detach(lazy_html)
+  end
+
+  @doc """
+  Returns the top-level nodes of the document `lazy_html` belongs to.
+
+  This is useful for getting back to the whole document after
+  modifying some of its nodes, see `set_attribute/3` and similar
+  functions.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<div><p>Hello</p></div><p>world</p>|)
+      iex> lazy_html |> LazyHTML.query("p") |> LazyHTML.document()
+      #LazyHTML<
+        2 nodes
+        #1
+        <div><p>Hello</p></div>
+        #2
+        <p>world</p>
+      >
+
+  """
+  @spec document(t()) :: t()
+  def document(%LazyHTML{} = lazy_html) do
+    LazyHTML.NIF.document(lazy_html)
+  end
+
+  @doc """
+  Sets the attribute `name` to `value` on every element in `lazy_html`.
+
+  Returns a new `LazyHTML` with the copies of the nodes in `lazy_html`,
+  within a modified copy of its document.
+
+  ## Copying
+
+  Documents are shared by all results derived from them, such as the
+  results of `query/2`, so they are never modified. Instead, the whole
+  document is copied, the copy is modified, and the result refers to
+  the copy. `lazy_html` and all values obtained from its document are
+  not affected.
+
+  The same applies to all functions modifying documents. Use
+  `document/1` on the result to get the whole modified document.
+
+  Since every call copies the whole document, prefer `modify/2` when
+  applying several modifications, which copies the document only once.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<nav><a href="/">Home</a><a href="https://example.com">Example</a></nav>|)
+      iex> lazy_html
+      ...> |> LazyHTML.query(~S|a[href^="https:"]|)
+      ...> |> LazyHTML.set_attribute("rel", "nofollow")
+      ...> |> LazyHTML.document()
+      ...> |> LazyHTML.to_html()
+      ~S|<nav><a href="/">Home</a><a href="https://example.com" rel="nofollow">Example</a></nav>|
+
+  """
+  @spec set_attribute(t(), String.t(), String.t()) :: t()
+  def set_attribute(%LazyHTML{} = lazy_html, name, value)
+      when is_binary(name) and is_binary(value) do
+    LazyHTML.NIF.set_attribute(lazy_html, name, value)
+  end
+
+  @doc """
+  Removes the attribute `name` from every element in `lazy_html`.
+
+  Returns a new `LazyHTML` with the copies of the nodes in `lazy_html`.
+
+  The document is copied before modifying it, see `set_attribute/3`.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<div class="card" hidden>Hello</div>|)
+      iex> lazy_html |> LazyHTML.remove_attribute("hidden") |> LazyHTML.to_html()
+      ~S|<div class="card">Hello</div>|
+
+  """
+  @spec remove_attribute(t(), String.t()) :: t()
+  def remove_attribute(%LazyHTML{} = lazy_html, name) when is_binary(name) do
+    LazyHTML.NIF.remove_attribute(lazy_html, name)
+  end
+
+  @doc """
+  Removes every node in `lazy_html` from the document.
+
+  Returns a new `LazyHTML` with the copies of the removed nodes, which
+  no longer belong to the document tree.
+
+  The document is copied before modifying it, see `set_attribute/3`.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<div><p>Hello</p><script>track()</script></div>|)
+      iex> lazy_html
+      ...> |> LazyHTML.query("script")
+      ...> |> LazyHTML.remove()
+      ...> |> LazyHTML.document()
+      ...> |> LazyHTML.to_html()
+      "<div><p>Hello</p></div>"
+
+  """
+  @spec remove(t()) :: t()
+  def remove(%LazyHTML{} = lazy_html) do
+    LazyHTML.NIF.remove(lazy_html)
+  end
+
+  @doc """
+  Replaces every node in `lazy_html` with the nodes parsed from `html`.
+
+  The HTML is parsed as a fragment within the parent of each node, so
+  for example `<td>` elements are kept within table rows.
+
+  Returns a new `LazyHTML` with the copies of the replaced nodes, which
+  no longer belong to the document tree.
+
+  The document is copied before modifying it, see `set_attribute/3`.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<div><span class="price">10</span></div>|)
+      iex> lazy_html
+      ...> |> LazyHTML.query(".price")
+      ...> |> LazyHTML.replace_with_html(~S|<b>9.99</b> <s>10</s>|)
+      ...> |> LazyHTML.document()
+      ...> |> LazyHTML.to_html()
+      "<div><b>9.99</b> <s>10</s></div>"
+
+  """
+  @spec replace_with_html(t(), String.t()) :: t()
+  def replace_with_html(%LazyHTML{} = lazy_html, html) when is_binary(html) do
+    LazyHTML.NIF.replace_with_html(lazy_html, html)
+  end
+
+  @doc """
+  Appends the nodes parsed from `html` as the last children of every
+  element in `lazy_html`.
+
+  Returns a new `LazyHTML` with the copies of the nodes in `lazy_html`.
+
+  The document is copied before modifying it, see `set_attribute/3`.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<ul><li>One</li></ul>|)
+      iex> lazy_html |> LazyHTML.append_html("<li>Two</li>") |> LazyHTML.to_html()
+      "<ul><li>One</li><li>Two</li></ul>"
+
+  """
+  @spec append_html(t(), String.t()) :: t()
+  def append_html(%LazyHTML{} = lazy_html, html) when is_binary(html) do
+    LazyHTML.NIF.append_html(lazy_html, html)
+  end
+
+  @doc """
+  Replaces the children of every element in `lazy_html` with a text
+  node, or the content of text and comment nodes, with `text`.
+
+  Returns a new `LazyHTML` with the copies of the nodes in `lazy_html`.
+
+  The document is copied before modifying it, see `set_attribute/3`.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<p>Hello <b>world</b></p>|)
+      iex> lazy_html |> LazyHTML.set_text("1 < 2") |> LazyHTML.to_html()
+      "<p>1 &lt; 2</p>"
+
+  """
+  @spec set_text(t(), String.t()) :: t()
+  def set_text(%LazyHTML{} = lazy_html, text) when is_binary(text) do
+    LazyHTML.NIF.set_text(lazy_html, text)
+  end
+
+  @doc ~S'''
+  Applies a list of modifications to a single copy of the document.
+
+  This is equivalent to calling the corresponding functions one after
+  another, however the document is copied only once, rather than once
+  per call, see `set_attribute/3`.
+
+  Each modification is one of:
+
+    * `{:set_attribute, name, value}`, see `set_attribute/3`
+    * `{:remove_attribute, name}`, see `remove_attribute/2`
+    * `:remove`, see `remove/1`
+    * `{:replace_with_html, html}`, see `replace_with_html/2`
+    * `{:append_html, html}`, see `append_html/2`
+    * `{:set_text, text}`, see `set_text/2`
+
+  A modification applies to every node in `lazy_html`. To apply it to
+  the elements matching a selector within `lazy_html` instead, wrap it
+  as `{selector, modification}`. The selector is matched against the
+  document as modified by the preceding modifications, same as with
+  `query/2`, and may be precompiled with `LazyHTML.Selector.compile/1`.
+
+  Returns a new `LazyHTML` with the copies of the nodes in `lazy_html`.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<article><h1>Title</h1><script>track()</script><a href="https://example.com">Link</a></article>|)
+      iex> lazy_html
+      ...> |> LazyHTML.modify([
+      ...>   {"script", :remove},
+      ...>   {"a", {:set_attribute, "rel", "nofollow"}},
+      ...>   {"h1", {:set_text, "News"}},
+      ...>   {:set_attribute, "class", "post"}
+      ...> ])
+      ...> |> LazyHTML.to_html()
+      ~S|<article class="post"><h1>News</h1><a href="https://example.com" rel="nofollow">Link</a></article>|
+
+  '''
+  @spec modify(t(), [modification | {String.t() | LazyHTML.Selector.t(), modification}]) ::
+          t()
+        when modification:
+               {:set_attribute, String.t(), String.t()}
+               | {:remove_attribute, String.t()}
+               | :remove
+               | {:replace_with_html, String.t()}
+               | {:append_html, String.t()}
+               | {:set_text, String.t()}
+  def modify(%LazyHTML{} = lazy_html, modifications) when is_list(modifications) do
+    modifications = Enum.map(modifications, &normalize_modification/1)
+    LazyHTML.NIF.modify(lazy_html, modifications)
+  end
+
+  defp normalize_modification({selector, modification})
+       when is_binary(selector) or is_struct(selector, LazyHTML.Selector) do
+    case normalize_modification(modification) do
+      {operation, nil, arg1, arg2} -> {operation, selector, arg1, arg2}
+      _nested -> raise ArgumentError, "invalid modification: #{inspect(modification)}"
+    end
+  end
+
+  defp normalize_modification({:set_attribute, name, value})
+       when is_binary(name) and is_binary(value),
+       do: {:set_attribute, nil, name, value}
+
+  defp normalize_modification({:remove_attribute, name}) when is_binary(name),
+    do: {:remove_attribute, nil, name, ""}
+
+  defp normalize_modification(:remove), do: {:remove, nil, "", ""}
+
+  defp normalize_modification({:replace_with_html, html}) when is_binary(html),
+    do: {:replace_with_html, nil, html, ""}
+
+  defp normalize_modification({:append_html, html}) when is_binary(html),
+    do: {:append_html, nil, html, ""}
+
+  defp normalize_modification({:set_text, text}) when is_binary(text),
+    do: {:set_text, nil, text, ""}
+
+  defp normalize_modification(other) do
+    raise ArgumentError, "invalid modification: #{inspect(other)}"
+  end
+
+  @doc """
+  Returns the number of bytes of native memory held by the document
+  `lazy_html` belongs to.
+
+  All results of `query/2` and similar functions reference the whole
+  document they come from, so as long as any of them is alive, the
+  whole document is kept in memory. The native memory is not visible
+  to the garbage collector, which only sees a small reference, so this
+  function can be used to find what keeps large documents around.
+
+  This includes the selector index, which is built once a document is
+  queried repeatedly, and the HTML cached with the `:memoize` option of
+  `to_html/2`.
+
+  ## Examples
+
+      iex> lazy_html = LazyHTML.from_fragment(~S|<div><span>Hello</span></div>|)
+      iex> span = LazyHTML.query(lazy_html, "span")
+      iex> LazyHTML.memory(span) == LazyHTML.memory(lazy_html)
+      true
+
+  """
+  @spec memory(t()) :: non_neg_integer()
+  def memory(%LazyHTML{} = lazy_html) do
+    LazyHTML.NIF.memory(lazy_html)
+  end
+
+  @doc """
+  Returns global native memory statistics.
+
+  The result includes the number of documents currently referenced
+  (`:documents`) and the total native memory they hold, in bytes
+  (`:bytes`).
+  """
+  @spec memory() :: %{documents: non_neg_integer(), bytes: non_neg_integer()}
+  def memory() do
+    {documents, bytes} = LazyHTML.NIF.memory_stats()
+    %{documents: documents, bytes: bytes}
+  end
+
   # Access
 
   @impl true
-  def fetch(%LazyHTML{} = lazy_html, selector) when is_binary(selector) do
+  def fetch(%LazyHTML{} = lazy_html, selector)
+      when is_binary(selector) or is_struct(selector, LazyHTML.Selector) do
     {:ok, query(lazy_html, selector)}
   end
 
@@ -502,10 +1171,19 @@ defimpl Inspect, for: LazyHTML do
   import Inspect.Algebra
 
   def inspect(lazy_html, opts) do
-    {nodes, from_selector} = LazyHTML.NIF.nodes(lazy_html)
+    count = LazyHTML.NIF.num_nodes(lazy_html)
+
+    # We only build the nodes that are going to be shown
+    limit =
+      case opts.limit do
+        :infinity -> count
+        limit -> limit
+      end
+
+    {nodes, from_selector} = LazyHTML.NIF.nodes(lazy_html, 0, limit)
 
     info =
-      case length(nodes) do
+      case count do
         1 -> "1 node"
         n -> "#{n} nodes"
       end
@@ -522,7 +1200,7 @@ defimpl Inspect, for: LazyHTML do
         empty()
       else
         items = Enum.with_index(nodes, 1)
-        {items, last_doc} = apply_limit(items, opts.limit)
+        last_doc = more_doc(count - length(nodes))
 
         inner =
           concat(Enum.map_intersperse(items, concat(separator(), line()), &node_to_doc(&1, opts)))
@@ -548,14 +1226,8 @@ defimpl Inspect, for: LazyHTML do
     defp separator(), do: empty()
   end
 
-  defp apply_limit(items, :infinity), do: {items, empty()}
-
-  defp apply_limit(items, limit) do
-    case Enum.split(items, limit) do
-      {items, []} -> {items, empty()}
-      {items, more} -> {items, concat([separator(), line(), "[#{length(more)} more]"])}
-    end
-  end
+  defp more_doc(0), do: empty()
+  defp more_doc(more), do: concat([separator(), line(), "[#{more} more]"])
 
   defp node_to_doc({%LazyHTML{} = node, number}, opts) do
     html_doc =
@@ -592,10 +1264,50 @@ defimpl Enumerable, for: LazyHTML do
 
   def member?(_lazy_html, _element), do: {:error, __MODULE__}
 
-  def slice(_lazy_html), do: {:error, __MODULE__}
+  def slice(lazy_html) do
+    size = LazyHTML.NIF.num_nodes(lazy_html)
+    {:ok, size, &slice_nodes(lazy_html, &1, &2, &3)}
+  end
+
+  defp slice_nodes(lazy_html, start, length, 1) do
+    {nodes, _from_selector} = LazyHTML.NIF.nodes(lazy_html, start, length)
+    nodes
+  end
+
+  defp slice_nodes(lazy_html, start, length, step) do
+    {nodes, _from_selector} = LazyHTML.NIF.nodes(lazy_html, start, (length - 1) * step + 1)
+    Enum.take_every(nodes, step)
+  end
+
+  # Nodes are built in chunks of increasing size, so that traversals
+  # stopping early, such as Enum.take/2, only build the nodes they need.
+  @max_chunk_size 256
 
   def reduce(%LazyHTML{} = lazy_html, acc, fun) do
-    {nodes, _from_selector} = LazyHTML.NIF.nodes(lazy_html)
-    Enumerable.reduce(nodes, acc, fun)
+    size = LazyHTML.NIF.num_nodes(lazy_html)
+    reduce(lazy_html, size, 0, 1, [], acc, fun)
+  end
+
+  defp reduce(_lazy_html, _size, _offset, _chunk_size, _nodes, {:halt, acc}, _fun) do
+    {:halted, acc}
+  end
+
+  defp reduce(lazy_html, size, offset, chunk_size, nodes, {:suspend, acc}, fun) do
+    {:suspended, acc, &reduce(lazy_html, size, offset, chunk_size, nodes, &1, fun)}
+  end
+
+  defp reduce(lazy_html, size, offset, chunk_size, [node | nodes], {:cont, acc}, fun) do
+    reduce(lazy_html, size, offset, chunk_size, nodes, fun.(node, acc), fun)
+  end
+
+  defp reduce(_lazy_html, size, offset, _chunk_size, [], {:cont, acc}, _fun)
+       when offset >= size do
+    {:done, acc}
+  end
+
+  defp reduce(lazy_html, size, offset, chunk_size, [], {:cont, acc}, fun) do
+    {nodes, _from_selector} = LazyHTML.NIF.nodes(lazy_html, offset, chunk_size)
+    next_chunk_size = min(chunk_size * 2, @max_chunk_size)
+    reduce(lazy_html, size, offset + chunk_size, next_chunk_size, nodes, {:cont, acc}, fun)
   end
 end
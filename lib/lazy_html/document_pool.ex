@@ -0,0 +1,47 @@
+defmodule LazyHTML.DocumentPool do
+  @moduledoc """
+  Controls the pool of recycled native documents.
+
+  Parsing allocates a native document, along with its memory arenas
+  and parser. When a document is no longer referenced, instead of
+  freeing it, we clean it and keep it in a pool, so that subsequent
+  parses can reuse the already allocated memory. The pool is split
+  per scheduler thread.
+
+  The maximum number of idle documents kept in the pool defaults to
+  64 and can be changed in the application configuration:
+
+      config :lazy_html, :document_pool_size, 128
+
+  Setting the size to `0` disables pooling.
+  """
+
+  @doc """
+  Returns pool statistics.
+
+  The result includes the number of parses that reused a pooled
+  document (`:hits`), the number of parses that had to create a new
+  document (`:misses`) and the number of idle documents currently
+  in the pool (`:size`).
+  """
+  @spec stats() :: %{
+          hits: non_neg_integer(),
+          misses: non_neg_integer(),
+          size: non_neg_integer()
+        }
+  def stats() do
+    {hits, misses, size} = LazyHTML.NIF.document_pool_stats()
+    %{hits: hits, misses: misses, size: size}
+  end
+
+  @doc """
+  Sets the maximum number of idle documents kept in the pool.
+
+  If the pool currently holds more documents, the extra ones are
+  freed.
+  """
+  @spec set_max_size(non_neg_integer()) :: :ok
+  def set_max_size(max_size) when is_integer(max_size) and max_size >= 0 do
+    LazyHTML.NIF.set_document_pool_size(max_size)
+  end
+end
@@ -7,26 +7,69 @@ defmodule LazyHTML.NIF do
     path = :filename.join(:code.priv_dir(:lazy_html), ~c"liblazy_html")
 
     case :erlang.load_nif(path, 0) do
-      :ok -> :ok
+      :ok ->
+        pool_size = Application.get_env(:lazy_html, :document_pool_size, 64)
+        set_document_pool_size(pool_size)
+
+        # Worker threads run alongside dirty schedulers, so we never
+        # start more of them than there are dirty CPU schedulers, and
+        # parallel calls together with their workers share a budget of
+        # as many threads as there are dirty CPU schedulers
+        dirty_cpu_schedulers = :erlang.system_info(:dirty_cpu_schedulers)
+        worker_pool_size = Application.get_env(:lazy_html, :worker_pool_size)
+        worker_pool_size = min(worker_pool_size || dirty_cpu_schedulers - 1, dirty_cpu_schedulers)
+        set_worker_pool_size(worker_pool_size, dirty_cpu_schedulers)
+
       {:error, reason} -> raise "failed to load NIF library, reason: #{inspect(reason)}"
     end
   end
 
   def from_document(_html), do: err!()
+  def from_documents(_htmls, _parallel), do: err!()
   def from_fragment(_html), do: err!()
-  def to_html(_lazy_html, _skip_whitespace_nodes), do: err!()
+  def parser_new(), do: err!()
+  def parser_feed(_parser, _html), do: err!()
+  def parser_finish(_parser), do: err!()
+  def to_html(_lazy_html, _skip_whitespace_nodes, _chunk_size, _memoize), do: err!()
+
+  def to_html_stream_new(_lazy_html, _skip_whitespace_nodes, _chunk_size, _memoize),
+    do: err!()
+
+  def to_html_stream_next(_stream), do: err!()
   def to_tree(_lazy_html, _sort_attributes, _skip_whitespace_nodes), do: err!()
   def from_tree(_tree), do: err!()
+  def detach(_lazy_html), do: err!()
+  def document(_lazy_html), do: err!()
+  def set_attribute(_lazy_html, _name, _value), do: err!()
+  def remove_attribute(_lazy_html, _name), do: err!()
+  def remove(_lazy_html), do: err!()
+  def replace_with_html(_lazy_html, _html), do: err!()
+  def append_html(_lazy_html, _html), do: err!()
+  def set_text(_lazy_html, _text), do: err!()
+  def modify(_lazy_html, _modifications), do: err!()
   def query(_lazy_html, _css_selector), do: err!()
+  def query_many(_lazy_html, _css_selectors), do: err!()
+  def extract(_lazy_html, _item_selector, _fields), do: err!()
   def filter(_lazy_html, _css_selector), do: err!()
   def query_by_id(_lazy_html, _id), do: err!()
+  def compile_selector(_css_selector), do: err!()
+  def selector_cache_stats(), do: err!()
   def child_nodes(_lazy_html), do: err!()
-  def text(_lazy_html), do: err!()
+  def text(_lazy_html, _visible_only, _block_separator, _collapse_whitespace), do: err!()
   def attribute(_lazy_html, _name), do: err!()
   def attributes(_lazy_html), do: err!()
   def tag(_lazy_html), do: err!()
-  def nodes(_lazy_html), do: err!()
+  def nodes(_lazy_html, _offset, _length), do: err!()
   def num_nodes(_lazy_html), do: err!()
+  def memory(_lazy_html), do: err!()
+  def memory_stats(), do: err!()
+  def set_document_pool_size(_max_size), do: err!()
+  def document_pool_stats(), do: err!()
+  def stats(), do: err!()
+  def reset_stats(), do: err!()
+  def set_worker_pool_size(_size, _max_threads), do: err!()
+  def debug_escape(_data, _scalar), do: err!()
+  def debug_leading_whitespace_size(_data, _scalar), do: err!()
 
   defp err!(), do: :erlang.nif_error(:not_loaded)
 end
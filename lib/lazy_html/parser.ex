@@ -0,0 +1,62 @@
+defmodule LazyHTML.Parser do
+  @moduledoc """
+  Incremental HTML document parser.
+
+  This module allows parsing a document as its chunks arrive, for
+  example when reading a response body from the network, without
+  accumulating the whole input first.
+
+  Note that the parser is a mutable object, `feed/2` returns the same
+  parser for convenience.
+
+  ## Examples
+
+      iex> parser = LazyHTML.Parser.new()
+      iex> parser = LazyHTML.Parser.feed(parser, "<html><body><p>Hel")
+      iex> parser = LazyHTML.Parser.feed(parser, "lo world!</p></body></html>")
+      iex> LazyHTML.Parser.finish(parser)
+      #LazyHTML<
+        1 node
+        #1
+        <html><head></head><body><p>Hello world!</p></body></html>
+      >
+
+  For parsing an enumerable of chunks, see `LazyHTML.from_stream/1`.
+  """
+
+  defstruct [:resource]
+
+  @type t :: %__MODULE__{resource: reference()}
+
+  @doc """
+  Starts parsing a new HTML document.
+  """
+  @spec new() :: t()
+  def new() do
+    LazyHTML.NIF.parser_new()
+  end
+
+  @doc """
+  Parses the next chunk of the document.
+
+  The chunk may end at any point in the input, including the middle
+  of a tag or a multi-byte character.
+  """
+  @spec feed(t(), String.t()) :: t()
+  def feed(%__MODULE__{} = parser, chunk) when is_binary(chunk) do
+    :ok = LazyHTML.NIF.parser_feed(parser, chunk)
+    parser
+  end
+
+  @doc """
+  Finishes parsing and returns the document.
+
+  Same as `LazyHTML.from_document/1`, missing `<html>`, `<head>` or
+  `<body>` tags are added. Once finished, the parser cannot be used
+  anymore.
+  """
+  @spec finish(t()) :: LazyHTML.t()
+  def finish(%__MODULE__{} = parser) do
+    LazyHTML.NIF.parser_finish(parser)
+  end
+end
@@ -0,0 +1,67 @@
+defmodule LazyHTML.Selector do
+  @moduledoc """
+  A precompiled CSS selector.
+
+  Functions such as `LazyHTML.query/2` and `LazyHTML.filter/2` accept
+  CSS selectors as strings, in which case the selector is parsed on
+  the first use and kept in a bounded cache. If you run the same
+  selector against many documents, you can compile it upfront and
+  pass the compiled selector instead, so that it never needs to be
+  parsed again.
+  """
+
+  defstruct [:resource, :source]
+
+  @type t :: %__MODULE__{resource: reference(), source: String.t()}
+
+  @doc """
+  Compiles the given CSS selector.
+
+  Raises `ArgumentError` if the selector is not valid.
+
+  ## Examples
+
+      iex> selector = LazyHTML.Selector.compile("span")
+      #LazyHTML.Selector<"span">
+      iex> lazy_html = LazyHTML.from_fragment(~S|<div><span>Hello</span></div>|)
+      iex> LazyHTML.query(lazy_html, selector)
+      #LazyHTML<
+        1 node (from selector)
+        #1
+        <span>Hello</span>
+      >
+
+  """
+  @spec compile(String.t()) :: t()
+  def compile(selector) when is_binary(selector) do
+    resource = LazyHTML.NIF.compile_selector(selector)
+    %__MODULE__{resource: resource, source: selector}
+  end
+
+  @doc """
+  Returns statistics of the cache of selectors given as strings.
+
+  The result includes the number of lookups that found the selector
+  in the cache (`:hits`), the number of lookups that had to parse it
+  (`:misses`) and the number of selectors currently in the cache
+  (`:size`). The cache holds up to 512 selectors, evicting the least
+  recently used ones.
+  """
+  @spec cache_stats() :: %{
+          hits: non_neg_integer(),
+          misses: non_neg_integer(),
+          size: non_neg_integer()
+        }
+  def cache_stats() do
+    {hits, misses, size} = LazyHTML.NIF.selector_cache_stats()
+    %{hits: hits, misses: misses, size: size}
+  end
+end
+
+defimpl Inspect, for: LazyHTML.Selector do
+  import Inspect.Algebra
+
+  def inspect(selector, opts) do
+    concat(["#LazyHTML.Selector<", to_doc(selector.source, opts), ">"])
+  end
+end
@@ -0,0 +1,100 @@
+defmodule LazyHTML.Telemetry do
+  @moduledoc """
+  Statistics of native calls, for monitoring.
+
+  Every call to a native function, such as parsing, querying or
+  serializing, updates a set of counters:
+
+    * `:calls` - the number of calls
+
+    * `:bytes_in` - the number of bytes of HTML or selectors given as
+      input
+
+    * `:bytes_out` - the number of bytes of HTML or text produced
+
+    * `:nodes` - the number of nodes processed, that is, nodes visited
+      when serializing, copying or extracting text, and nodes returned
+      by queries
+
+    * `:total_time` - the cumulative time spent in the calls, in
+      nanoseconds
+
+    * `:max_time` - the longest time spent in a single call, in
+      nanoseconds. Functions that yield on large documents, such as
+      `LazyHTML.to_html/2`, are measured per run between yields
+
+  The counters are kept per scheduler thread and updating them takes
+  only a few uncontended atomic additions, so they are always enabled.
+
+  ## Telemetry
+
+  The counters can be reported periodically with
+  [`:telemetry_poller`](https://hexdocs.pm/telemetry_poller):
+
+      {:telemetry_poller,
+       measurements: [{LazyHTML.Telemetry, :dispatch_stats, []}],
+       period: :timer.seconds(10)}
+
+  See `dispatch_stats/0` for the emitted events.
+  """
+
+  @type stats :: %{
+          calls: non_neg_integer(),
+          bytes_in: non_neg_integer(),
+          bytes_out: non_neg_integer(),
+          nodes: non_neg_integer(),
+          total_time: non_neg_integer(),
+          max_time: non_neg_integer()
+        }
+
+  @doc """
+  Returns the counters of every native function, keyed by the function
+  name.
+  """
+  @spec stats() :: %{atom() => stats()}
+  def stats() do
+    for {name, calls, bytes_in, bytes_out, nodes, total_time, max_time} <-
+          LazyHTML.NIF.stats(),
+        into: %{} do
+      {name,
+       %{
+         calls: calls,
+         bytes_in: bytes_in,
+         bytes_out: bytes_out,
+         nodes: nodes,
+         total_time: total_time,
+         max_time: max_time
+       }}
+    end
+  end
+
+  @doc """
+  Resets all counters to zero.
+  """
+  @spec reset_stats() :: :ok
+  def reset_stats() do
+    LazyHTML.NIF.reset_stats()
+  end
+
+  @doc """
+  Emits a `[:lazy_html, :nif]` telemetry event for every native function
+  that has been called.
+
+  The measurements are the counters described in the module
+  documentation and the metadata is `%{function: name}`. The counters
+  are cumulative, so reporters should track the last value or compute
+  differences between events.
+
+  Requires the `:telemetry` application, which is not a dependency of
+  this library.
+  """
+  @spec dispatch_stats() :: :ok
+  def dispatch_stats() do
+    for {name, %{calls: calls} = measurements} <- stats(), calls > 0 do
+      # Called dynamically, since :telemetry is an optional dependency.
+      apply(:telemetry, :execute, [[:lazy_html, :nif], measurements, %{function: name}])
+    end
+
+    :ok
+  end
+end
@@ -152,7 +152,8 @@ defmodule DoctestWithZigTest do
     def inspect(lazy_html, opts) do
       # Convert to LazyHTML struct for getting nodes
       lazy_html_struct = %LazyHTML{resource: lazy_html.resource}
-      {nodes, from_selector} = LazyHTML.NIF.nodes(lazy_html_struct)
+      count = LazyHTML.NIF.num_nodes(lazy_html_struct)
+      {nodes, from_selector} = LazyHTML.NIF.nodes(lazy_html_struct, 0, count)
 
       info =
         case length(nodes) do
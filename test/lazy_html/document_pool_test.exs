@@ -0,0 +1,31 @@
+defmodule LazyHTML.DocumentPoolTest do
+  use ExUnit.Case
+
+  test "stats/0" do
+    assert %{hits: hits, misses: misses, size: size} = LazyHTML.DocumentPool.stats()
+    assert is_integer(hits) and is_integer(misses) and is_integer(size)
+  end
+
+  test "recycled documents parse the same as new ones" do
+    for _ <- 1..50 do
+      # Documents without doctype are parsed in quirks mode, in which
+      # class selectors are case-insensitive. That must not leak into
+      # the fragments parsed with the recycled document.
+      lazy_html = LazyHTML.from_document(~S|<div class="Item">Hello</div>|)
+      assert Enum.count(LazyHTML.query(lazy_html, ".item")) == 1
+
+      lazy_html = LazyHTML.from_fragment(~S|<div class="Item">Hello</div>|)
+      assert Enum.count(LazyHTML.query(lazy_html, ".item")) == 0
+      assert LazyHTML.to_html(lazy_html) == ~S|<div class="Item">Hello</div>|
+
+      :erlang.garbage_collect()
+    end
+  end
+
+  test "set_max_size/1 frees extra idle documents" do
+    assert :ok = LazyHTML.DocumentPool.set_max_size(0)
+    assert LazyHTML.DocumentPool.stats().size == 0
+  after
+    LazyHTML.DocumentPool.set_max_size(64)
+  end
+end
@@ -0,0 +1,49 @@
+defmodule LazyHTML.ParserTest do
+  use ExUnit.Case
+
+  doctest LazyHTML.Parser
+
+  test "parses the same document regardless of chunk boundaries" do
+    html = """
+    <!DOCTYPE html>
+    <html><head><title>Page &amp; title</title></head>
+    <body>
+      <div id="root" class="layout" data-value="a &quot;b&quot;">
+        Hello 🔥 world
+        <!-- Comment -->
+        <script>if (a < b && c > d) {}</script>
+        <template><p>Inside</p></template>
+      </div>
+    </body></html>
+    """
+
+    expected = LazyHTML.to_html(LazyHTML.from_document(html))
+
+    for chunk_size <- [1, 2, 3, 7, 64] do
+      chunks = for <<chunk::binary-size(chunk_size) <- html>>, do: chunk
+      rest_size = rem(byte_size(html), chunk_size)
+      chunks = chunks ++ [binary_part(html, byte_size(html) - rest_size, rest_size)]
+
+      assert LazyHTML.to_html(LazyHTML.from_stream(chunks)) == expected
+    end
+  end
+
+  test "accepts a stream" do
+    stream = Stream.map(1..3, &"<p>#{&1}</p>")
+
+    assert LazyHTML.text(LazyHTML.from_stream(stream)) == "123"
+  end
+
+  test "raises when used after finish" do
+    parser = LazyHTML.Parser.new()
+    LazyHTML.Parser.finish(parser)
+
+    assert_raise ArgumentError, ~r/parser has already finished/, fn ->
+      LazyHTML.Parser.feed(parser, "<div></div>")
+    end
+
+    assert_raise ArgumentError, ~r/parser has already finished/, fn ->
+      LazyHTML.Parser.finish(parser)
+    end
+  end
+end
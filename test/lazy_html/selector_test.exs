@@ -0,0 +1,40 @@
+defmodule LazyHTML.SelectorTest do
+  use ExUnit.Case
+
+  doctest LazyHTML.Selector
+
+  describe "compile/1" do
+    test "raises when an invalid selector is given" do
+      assert_raise ArgumentError, ~r/got invalid css selector: hover:/, fn ->
+        LazyHTML.Selector.compile("hover:")
+      end
+    end
+
+    test "can be used with query/2, filter/2 and Access" do
+      lazy_html =
+        LazyHTML.from_fragment("""
+        <span class="a">Hello</span><div><span class="a">nested</span></div>\
+        """)
+
+      selector = LazyHTML.Selector.compile(".a")
+
+      assert LazyHTML.to_html(LazyHTML.query(lazy_html, selector)) ==
+               LazyHTML.to_html(LazyHTML.query(lazy_html, ".a"))
+
+      assert LazyHTML.to_html(LazyHTML.filter(lazy_html, selector)) ==
+               ~S|<span class="a">Hello</span>|
+
+      assert LazyHTML.to_html(lazy_html[selector]) ==
+               ~S|<span class="a">Hello</span><span class="a">nested</span>|
+    end
+
+    test "can be reused across documents" do
+      selector = LazyHTML.Selector.compile("p")
+
+      for i <- 1..10 do
+        lazy_html = LazyHTML.from_fragment("<div><p>#{i}</p></div>")
+        assert LazyHTML.text(LazyHTML.query(lazy_html, selector)) == "#{i}"
+      end
+    end
+  end
+end
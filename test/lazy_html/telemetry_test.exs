@@ -0,0 +1,34 @@
+defmodule LazyHTML.TelemetryTest do
+  use ExUnit.Case
+
+  test "stats/0 counts calls, bytes and nodes" do
+    LazyHTML.Telemetry.reset_stats()
+
+    html = "<div><p>Hello</p><p>world</p></div>"
+    lazy_html = LazyHTML.from_fragment(html)
+    assert LazyHTML.to_html(lazy_html) == html
+    assert lazy_html |> LazyHTML.query("p") |> Enum.count() == 2
+
+    stats = LazyHTML.Telemetry.stats()
+
+    assert %{calls: 1, bytes_in: bytes_in} = stats.from_fragment
+    assert bytes_in == byte_size(html)
+
+    assert %{calls: 1, bytes_out: bytes_out, nodes: 5} = stats.to_html
+    assert bytes_out == byte_size(html)
+
+    assert %{calls: 1, nodes: 2} = stats.query
+    assert stats.query.total_time >= stats.query.max_time
+
+    assert %{calls: 0} = stats.from_tree
+  end
+
+  test "reset_stats/0 clears all counters" do
+    LazyHTML.from_fragment("<p>Hello</p>")
+    assert :ok = LazyHTML.Telemetry.reset_stats()
+
+    for {_name, stats} <- LazyHTML.Telemetry.stats() do
+      assert stats == %{calls: 0, bytes_in: 0, bytes_out: 0, nodes: 0, total_time: 0, max_time: 0}
+    end
+  end
+end
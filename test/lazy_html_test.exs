@@ -73,6 +73,29 @@ defmodule LazyHTMLTest do
     end
   end
 
+  describe "from_documents/2" do
+    test "parses all documents in order" do
+      htmls = for i <- 1..100, do: "<p>#{i}</p>"
+
+      for parallel <- [true, false] do
+        results = LazyHTML.from_documents(htmls, parallel: parallel)
+
+        assert Enum.map(results, fn {:ok, lazy_html} -> LazyHTML.text(lazy_html["p"]) end) ==
+                 Enum.map(1..100, &to_string/1)
+      end
+    end
+
+    test "returns an empty list for no documents" do
+      assert LazyHTML.from_documents([]) == []
+    end
+
+    test "raises when an element is not a binary" do
+      assert_raise ArgumentError, fn ->
+        LazyHTML.from_documents(["<p></p>", :oops])
+      end
+    end
+  end
+
   describe "from_fragment/1" do
     test "empty" do
       lazy_html = LazyHTML.from_fragment("")
@@ -162,6 +185,140 @@ defmodule LazyHTMLTest do
       assert LazyHTML.to_html(lazy_html) ==
                "<template><div>First</div><div>Second</div></template>"
     end
+
+    test "vectorized escaping matches the scalar one on random inputs" do
+      :rand.seed(:exsss, {1, 2, 3})
+
+      for _ <- 1..2000 do
+        text = random_text(:rand.uniform(10) - 1)
+
+        escaped = LazyHTML.NIF.debug_escape(text, false)
+        assert escaped == LazyHTML.NIF.debug_escape(text, true)
+
+        assert LazyHTML.NIF.debug_leading_whitespace_size(text, false) ==
+                 LazyHTML.NIF.debug_leading_whitespace_size(text, true)
+
+        # The Elixir serializer applies the same escaping
+        tree = [{"div", [{"title", text}], [text]}]
+        assert LazyHTML.to_html(LazyHTML.from_tree(tree)) == LazyHTML.Tree.to_html(tree)
+      end
+    end
+
+    test "large documents that take multiple timeslices" do
+      html = String.duplicate(~S|<div class="a"><span>x &amp; y</span><br/></div>|, 50_000)
+      lazy_html = LazyHTML.from_fragment(html)
+
+      assert LazyHTML.to_html(lazy_html) == html
+    end
+
+    test "with :chunk_size returns fixed-size chunks" do
+      html = String.duplicate(~S|<div class="a"><span>x &amp; y</span><br></div>|, 50_000)
+      lazy_html = LazyHTML.from_fragment(html)
+
+      chunks = LazyHTML.to_html(lazy_html, chunk_size: 1000)
+
+      assert IO.iodata_to_binary(chunks) == html
+      assert Enum.all?(Enum.drop(chunks, -1), &(byte_size(&1) == 1000))
+      assert byte_size(List.last(chunks)) in 1..1000
+
+      assert LazyHTML.to_html(LazyHTML.from_fragment(""), chunk_size: 10) == []
+
+      assert_raise ArgumentError, fn -> LazyHTML.to_html(lazy_html, chunk_size: 0) end
+    end
+
+    test "with :memoize returns the same html and caches it on the document" do
+      lazy_html =
+        LazyHTML.from_document("""
+        <html><body>
+          <nav> <a href="/">Home</a> <br> </nav>
+          <p>Hello &amp; welcome</p>
+        </body></html>
+        """)
+
+      nodes = LazyHTML.query(lazy_html, "nav, br, p")
+      memory = LazyHTML.memory(lazy_html)
+
+      for skip_whitespace_nodes <- [false, true], _ <- 1..3 do
+        opts = [skip_whitespace_nodes: skip_whitespace_nodes]
+        assert LazyHTML.to_html(nodes, [memoize: true] ++ opts) == LazyHTML.to_html(nodes, opts)
+      end
+
+      assert LazyHTML.memory(lazy_html) > memory
+
+      assert IO.iodata_to_binary(LazyHTML.to_html(nodes, memoize: true, chunk_size: 5)) ==
+               LazyHTML.to_html(nodes)
+
+      assert lazy_html |> LazyHTML.to_html_stream(memoize: true) |> Enum.join() ==
+               LazyHTML.to_html(lazy_html)
+    end
+
+    test "with :memoize does not cache elements larger than the cache" do
+      # More than the 4 MiB held per document.
+      html = "<div>" <> String.duplicate("<p>Hello</p>", 400_000) <> "</div>"
+      lazy_html = LazyHTML.from_fragment(html)
+      memory = LazyHTML.memory(lazy_html)
+
+      assert LazyHTML.to_html(lazy_html, memoize: true) == html
+      assert LazyHTML.memory(lazy_html) == memory
+    end
+
+    test "with :memoize does not cache parts of elements larger than the cache" do
+      html =
+        "<div>\n" <> String.duplicate("<p>Hello</p>\n", 400_000) <> " <footer>x</footer>\n</div>"
+
+      lazy_html = LazyHTML.from_fragment(html)
+      memory = LazyHTML.memory(lazy_html)
+
+      assert LazyHTML.to_html(lazy_html, memoize: true) == html
+      assert LazyHTML.to_html(lazy_html, memoize: true) == html
+      assert LazyHTML.memory(lazy_html) == memory
+    end
+
+    test "with :memoize and :chunk_size only reuses cached html" do
+      lazy_html = LazyHTML.from_fragment("<p>Hello</p><p>world</p>")
+      memory = LazyHTML.memory(lazy_html)
+
+      assert LazyHTML.to_html(lazy_html, memoize: true, chunk_size: 4) ==
+               ["<p>H", "ello", "</p>", "<p>w", "orld", "</p>"]
+
+      assert lazy_html |> LazyHTML.to_html_stream(memoize: true) |> Enum.join() ==
+               "<p>Hello</p><p>world</p>"
+
+      assert LazyHTML.memory(lazy_html) == memory
+
+      assert LazyHTML.to_html(lazy_html, memoize: true) == "<p>Hello</p><p>world</p>"
+      assert LazyHTML.memory(lazy_html) > memory
+
+      assert LazyHTML.to_html(lazy_html, memoize: true, chunk_size: 4) ==
+               ["<p>H", "ello", "</p>", "<p>w", "orld", "</p>"]
+    end
+  end
+
+  describe "to_html_stream/2" do
+    test "emits the same html as to_html/2" do
+      html = String.duplicate(~S|<div class="a"><span>x &amp; y</span><br></div>|, 50_000)
+      lazy_html = LazyHTML.from_fragment(html)
+
+      chunks = lazy_html |> LazyHTML.to_html_stream(chunk_size: 4096) |> Enum.to_list()
+
+      assert IO.iodata_to_binary(chunks) == html
+      assert Enum.all?(Enum.drop(chunks, -1), &(byte_size(&1) == 4096))
+    end
+
+    test "can be consumed partially" do
+      lazy_html = LazyHTML.from_fragment(String.duplicate("<p>Hello</p>", 1000))
+
+      assert lazy_html |> LazyHTML.to_html_stream(chunk_size: 6) |> Enum.take(2) ==
+               ["<p>Hel", "lo</p>"]
+    end
+
+    test "with :skip_whitespace_nodes" do
+      lazy_html = LazyHTML.from_fragment("<p>\n  <span>Hello</span>\n</p>")
+
+      assert lazy_html
+             |> LazyHTML.to_html_stream(skip_whitespace_nodes: true)
+             |> Enum.join() == "<p><span>Hello</span></p>"
+    end
   end
 
   describe "to_tree/2" do
@@ -183,6 +340,19 @@ defmodule LazyHTMLTest do
              ]
     end
 
+    test "attributes with empty values and repeated names" do
+      lazy_html =
+        LazyHTML.from_fragment(
+          ~S|<input disabled value=""><input disabled value="x"><svg viewBox="0 0 1 1"></svg>|
+        )
+
+      assert LazyHTML.to_tree(lazy_html, sort_attributes: true) == [
+               {"input", [{"disabled", ""}, {"value", ""}], []},
+               {"input", [{"disabled", ""}, {"value", "x"}], []},
+               {"svg", [{"viewBox", "0 0 1 1"}], []}
+             ]
+    end
+
     test "includes template children" do
       lazy_html =
         LazyHTML.from_fragment("<template><div>First</div><div>Second</div></template>")
@@ -204,6 +374,17 @@ defmodule LazyHTMLTest do
       assert LazyHTML.to_tree(lazy_html, skip_whitespace_nodes: true) ==
                [{"p", [], [{"span", [], ["  Hello  "]}, {"span", [], ["  world  "]}]}]
     end
+
+    test "large documents that take multiple timeslices" do
+      item = ~S|<div class="a"><span>x &amp; y</span><!-- c --></div>|
+      html = String.duplicate(item, 50_000)
+      lazy_html = LazyHTML.from_fragment(html)
+
+      tree = LazyHTML.to_tree(lazy_html)
+
+      assert length(tree) == 50_000
+      assert LazyHTML.Tree.to_html(tree) == html
+    end
   end
 
   describe "from_tree/2" do
@@ -239,6 +420,42 @@ defmodule LazyHTMLTest do
              >\
              """
     end
+
+    test "round-trips to_tree/2" do
+      html = ~S"""
+      <div class="a" data-x="1"><!-- comment --><p>Hello <b>world</b></p></div>
+      <template><span>template</span></template>
+      text &amp; <script>1 < 2</script>
+      """
+
+      tree = html |> LazyHTML.from_fragment() |> LazyHTML.to_tree()
+
+      assert tree |> LazyHTML.from_tree() |> LazyHTML.to_tree() == tree
+    end
+
+    test "handles deeply nested trees" do
+      tree = Enum.reduce(1..100_000, ["x"], fn _, children -> [{"span", [], children}] end)
+
+      assert tree |> LazyHTML.from_tree() |> LazyHTML.text() == "x"
+    end
+
+    test "raises on invalid tree nodes" do
+      assert_raise ArgumentError, ~r/expected a tree node/, fn ->
+        LazyHTML.from_tree([{"div", [], [1]}])
+      end
+
+      assert_raise ArgumentError, ~r/tuple contains unexpected atom: :other/, fn ->
+        LazyHTML.from_tree([{:other, "content"}])
+      end
+
+      assert_raise ArgumentError, ~r/expected attributes to be {name, value} tuples/, fn ->
+        LazyHTML.from_tree([{"div", ["class"], []}])
+      end
+
+      assert_raise ArgumentError, ~r/expected children to be a list/, fn ->
+        LazyHTML.from_tree([{"div", [], "text"}])
+      end
+    end
   end
 
   describe "query/2" do
@@ -248,6 +465,135 @@ defmodule LazyHTMLTest do
         LazyHTML.query(lazy_html, "hover:")
       end
     end
+
+    test "evicts least recently used selectors from the cache" do
+      lazy_html = LazyHTML.from_fragment(~S|<div data-id="1"></div>|)
+
+      cached? = fn selector ->
+        %{hits: hits} = LazyHTML.Selector.cache_stats()
+        LazyHTML.query(lazy_html, selector)
+        LazyHTML.Selector.cache_stats().hits == hits + 1
+      end
+
+      LazyHTML.query(lazy_html, ~s|[data-id="evicted"]|)
+      LazyHTML.query(lazy_html, ~s|[data-id="kept"]|)
+      assert cached?.(~s|[data-id="evicted"]|)
+
+      # More selectors than the cache holds, while keeping one of them
+      # recently used.
+      for i <- 1..1000 do
+        if rem(i, 100) == 0, do: LazyHTML.query(lazy_html, ~s|[data-id="kept"]|)
+        LazyHTML.query(lazy_html, ~s|[data-id="#{i}"]|)
+      end
+
+      assert LazyHTML.Selector.cache_stats().size == 512
+      assert cached?.(~s|[data-id="kept"]|)
+      assert cached?.(~s|[data-id="1000"]|)
+      refute cached?.(~s|[data-id="evicted"]|)
+      refute cached?.(~s|[data-id="1"]|)
+    end
+
+    test "returns matches in root order for many roots" do
+      rows = Enum.map_join(1..2000, &~s|<tr><td class="a">#{&1}</td><td>x</td></tr>|)
+      lazy_html = LazyHTML.from_document("<table>#{rows}</table>")
+
+      roots = LazyHTML.query(lazy_html, "tr")
+      assert Enum.count(roots) == 2000
+
+      expected = Enum.map(1..2000, &to_string/1)
+
+      for selector <- ["td.a", "tr > td:first-child"] do
+        assert roots |> LazyHTML.query(selector) |> Enum.map(&LazyHTML.text/1) == expected
+      end
+    end
+
+    test "returns the same results when answered from the selector index" do
+      html = ~S"""
+      <div class="card Card" id="first" data-testid="x">
+        <a href="/1" class="price">1</a>
+        <span class="price sale">2</span>
+      </div>
+      <DIV class="card"><span data-testid="y" class="price">3</span></DIV>
+      <svg viewBox="0 0 1 1"><foreignObject></foreignObject></svg>
+      <template><div class="card"></div></template>
+      """
+
+      selectors = [
+        "div",
+        "a",
+        ".price",
+        ".card",
+        ".Card",
+        "#first",
+        "span.price.sale",
+        "div.card",
+        ~S|[data-testid]|,
+        ~S|[data-testid="y"]|,
+        ~S|[viewbox]|,
+        "foreignObject",
+        ".price:first-child",
+        "div .price",
+        ".missing"
+      ]
+
+      # Query a fresh document for the expected result, before the
+      # index is built
+      expected = fn selector, roots_selector ->
+        html
+        |> LazyHTML.from_fragment()
+        |> then(&if(roots_selector, do: LazyHTML.query(&1, roots_selector), else: &1))
+        |> LazyHTML.query(selector)
+        |> LazyHTML.to_tree()
+      end
+
+      lazy_html = LazyHTML.from_fragment(html)
+
+      for _ <- 1..5, selector <- selectors do
+        assert lazy_html |> LazyHTML.query(selector) |> LazyHTML.to_tree() ==
+                 expected.(selector, nil)
+      end
+
+      roots = LazyHTML.query(lazy_html, "div, span")
+
+      for _ <- 1..5, selector <- selectors do
+        assert roots |> LazyHTML.query(selector) |> LazyHTML.to_tree() ==
+                 expected.(selector, "div, span")
+      end
+    end
+  end
+
+  describe "query_many/2" do
+    test "returns the same results as query/2 for each selector" do
+      lazy_html =
+        LazyHTML.from_fragment(~S"""
+        <div class="a"><span id="x">1</span><p>2</p></div>
+        <div class="b"><span>3</span><span class="c">4</span></div>
+        <template><span>5</span></template>
+        """)
+
+      compiled = LazyHTML.Selector.compile("div > span:last-child")
+
+      selectors = ["span", "div", ".b span, #x", ".missing", "div span + span", compiled]
+
+      for lazy_html <- [lazy_html, LazyHTML.query(lazy_html, "div, span")] do
+        results = LazyHTML.query_many(lazy_html, selectors)
+
+        assert Enum.map(results, &LazyHTML.to_tree/1) ==
+                 Enum.map(selectors, &LazyHTML.to_tree(LazyHTML.query(lazy_html, &1)))
+      end
+    end
+
+    test "returns an empty list for no selectors" do
+      lazy_html = LazyHTML.from_fragment("<div></div>")
+      assert LazyHTML.query_many(lazy_html, []) == []
+    end
+
+    test "raises when an invalid selector is given" do
+      assert_raise ArgumentError, ~r/got invalid css selector: hover:/, fn ->
+        lazy_html = LazyHTML.from_fragment("<div></div>")
+        LazyHTML.query_many(lazy_html, ["div", "hover:"])
+      end
+    end
   end
 
   describe "query_by_id/2" do
@@ -284,14 +630,426 @@ defmodule LazyHTMLTest do
       result = LazyHTML.query_by_id(lazy_html, "root")
       assert Enum.count(result) == 1
     end
+
+    test "only finds elements within the root nodes" do
+      lazy_html =
+        LazyHTML.from_fragment(~S"""
+        <div class="a"><span id="x">1</span></div>
+        <div class="b"><span id="x">2</span><span id="y">3</span></div>
+        """)
+
+      assert lazy_html |> LazyHTML.query_by_id("x") |> LazyHTML.text() == "12"
+
+      b = LazyHTML.query(lazy_html, ".b")
+      assert b |> LazyHTML.query_by_id("x") |> LazyHTML.text() == "2"
+      assert b |> LazyHTML.query_by_id("y") |> LazyHTML.text() == "3"
+      assert b |> LazyHTML.query_by_id("z") |> Enum.count() == 0
+
+      a = LazyHTML.query(lazy_html, ".a")
+      assert a |> LazyHTML.query_by_id("y") |> Enum.count() == 0
+    end
+
+    test "returns matches grouped by root in root order" do
+      lazy_html =
+        LazyHTML.from_fragment(~S"""
+        <div class="a"><span id="x">1</span></div>
+        <div class="b"><span id="x">2</span></div>
+        """)
+
+      # One root is an ancestor of another, so the element is found twice
+      roots = LazyHTML.query(lazy_html, ".a, .a span, .b")
+
+      assert roots |> LazyHTML.query_by_id("x") |> Enum.map(&LazyHTML.text/1) ==
+               ["1", "1", "2"]
+    end
   end
 
-  describe "text/1" do
+  describe "text/2" do
+    test "does not include template contents" do
+      lazy_html = LazyHTML.from_fragment(~S|<div>a<template>b</template><!-- c -->d</div>e|)
+      assert LazyHTML.text(lazy_html) == "ade"
+    end
+
+    test "handles deeply nested documents" do
+      html = String.duplicate("<div>", 10_000) <> "x" <> String.duplicate("</div>", 10_000)
+      lazy_html = LazyHTML.from_fragment(html)
+
+      assert LazyHTML.text(lazy_html) == "x"
+      assert LazyHTML.to_html(lazy_html) == html
+      assert Enum.count(LazyHTML.query(lazy_html, "div")) == 10_000
+    end
+
     test "ignores root comment nodes" do
       lazy_html = LazyHTML.from_fragment(~S|<!-- Comment -->Hello <span>world</span>|)
 
       assert LazyHTML.text(lazy_html) == "Hello world"
     end
+
+    test "with :visible_only skips elements that are not rendered" do
+      lazy_html =
+        LazyHTML.from_fragment(
+          ~S|a<script>b</script><style>c</style><noscript>d</noscript><p hidden>e</p>f|
+        )
+
+      assert LazyHTML.text(lazy_html) == "abcdef"
+      assert LazyHTML.text(lazy_html, visible_only: true) == "af"
+    end
+
+    test "with :block_separator separates block-level elements" do
+      lazy_html =
+        LazyHTML.from_fragment(
+          ~S|<div><p>a<b>b</b></p><p></p><ul><li>c</li><li>d<br>e</li></ul></div><span>f</span>|
+        )
+
+      assert LazyHTML.text(lazy_html) == "abcdef"
+      assert LazyHTML.text(lazy_html, block_separator: "|") == "ab|c|d|e|f"
+    end
+
+    test "with :collapse_whitespace collapses and trims whitespace" do
+      lazy_html = LazyHTML.from_fragment("\n  <p> a \t b </p>\n\n<p>c</p>  d  ")
+
+      assert LazyHTML.text(lazy_html, collapse_whitespace: true) == "a b c d"
+
+      assert LazyHTML.text(lazy_html, collapse_whitespace: true, block_separator: "\n") ==
+               "a b\nc\nd"
+    end
+
+    test "options match text of each root" do
+      lazy_html =
+        LazyHTML.from_fragment(~S|<p> a <span> b </span></p><p>c <script>x</script></p>|)
+
+      opts = [visible_only: true, block_separator: "\n", collapse_whitespace: true]
+
+      assert lazy_html |> LazyHTML.query("p") |> Enum.map(&LazyHTML.text(&1, opts)) ==
+               ["a b", "c"]
+    end
+  end
+
+  describe "extract/3" do
+    setup do
+      lazy_html =
+        LazyHTML.from_fragment(~S"""
+        <ul>
+          <li class="item"><a href="/a">A</a> <span class="tag">x</span></li>
+          <li class="item"><a href="/b">B</a></li>
+          <li class="item"><span class="tag">y</span><span class="tag">z</span></li>
+        </ul>
+        """)
+
+      %{lazy_html: lazy_html}
+    end
+
+    test "returns the same values as chaining query/2", %{lazy_html: lazy_html} do
+      spec = [
+        text: {"a", :text},
+        links: {"a", {:attr, "href"}},
+        html: {".tag", :html},
+        count: {".item", :count},
+        missing: {".missing", :text}
+      ]
+
+      assert LazyHTML.extract(lazy_html, spec) == %{
+               text: lazy_html |> LazyHTML.query("a") |> LazyHTML.text(),
+               links: lazy_html |> LazyHTML.query("a") |> LazyHTML.attribute("href"),
+               html: lazy_html |> LazyHTML.query(".tag") |> LazyHTML.to_html(),
+               count: 3,
+               missing: ""
+             }
+    end
+
+    test "evaluates the spec within each item", %{lazy_html: lazy_html} do
+      selector = LazyHTML.Selector.compile(".tag")
+      spec = %{name: {"a", :text}, tags: {selector, :count}}
+
+      assert LazyHTML.extract(lazy_html, spec, items: "li") == [
+               %{name: "A", tags: 1},
+               %{name: "B", tags: 0},
+               %{name: "", tags: 2}
+             ]
+
+      assert LazyHTML.extract(lazy_html, spec, items: ".missing") == []
+    end
+
+    test "raises on invalid spec", %{lazy_html: lazy_html} do
+      assert_raise ArgumentError, ~r/invalid extractor: :name/, fn ->
+        LazyHTML.extract(lazy_html, %{name: {"a", :name}})
+      end
+
+      assert_raise ArgumentError, ~r/got invalid css selector: hover:/, fn ->
+        LazyHTML.extract(lazy_html, %{name: {"hover:", :text}})
+      end
+    end
+  end
+
+  describe "detach/1" do
+    test "copies root nodes with their descendants" do
+      html = ~S"""
+      <div class="a" data-x="1"><!-- comment --><p>Hello <b>world</b></p></div>
+      <template><span>template</span></template>
+      <svg viewBox="0 0 1 1"><circle r="1"></circle></svg>
+      text &amp; <script>1 < 2</script>
+      """
+
+      lazy_html = LazyHTML.from_fragment(html)
+      detached = LazyHTML.detach(lazy_html)
+
+      assert LazyHTML.to_tree(detached) == LazyHTML.to_tree(lazy_html)
+      assert LazyHTML.to_html(detached) == LazyHTML.to_html(lazy_html)
+      assert LazyHTML.query(detached, "b") |> LazyHTML.text() == "world"
+    end
+
+    test "copies query results into a smaller document" do
+      lazy_html =
+        LazyHTML.from_document(String.duplicate("<p>filler</p>", 10_000) <> "<article>x</article>")
+
+      article = lazy_html |> LazyHTML.query("article") |> LazyHTML.detach()
+
+      assert LazyHTML.to_html(article) == "<article>x</article>"
+      assert LazyHTML.memory(article) < LazyHTML.memory(lazy_html)
+      assert inspect(article) =~ "(from selector)"
+    end
+
+    test "handles deeply nested trees" do
+      html = String.duplicate("<span>", 10_000) <> "x"
+      lazy_html = LazyHTML.from_fragment(html)
+
+      assert lazy_html |> LazyHTML.detach() |> LazyHTML.text() == "x"
+    end
+  end
+
+  describe "document/1" do
+    test "returns the top-level nodes of the document" do
+      lazy_html = LazyHTML.from_document("<p>Hello</p>")
+      document = lazy_html |> LazyHTML.query("p") |> LazyHTML.document()
+
+      assert LazyHTML.to_html(document) == LazyHTML.to_html(lazy_html)
+    end
+  end
+
+  describe "modifications" do
+    test "do not modify the original document" do
+      lazy_html = LazyHTML.from_fragment(~S|<p>Hello</p>|)
+
+      result = LazyHTML.set_attribute(lazy_html, "class", "a")
+
+      assert LazyHTML.to_html(result) == ~S|<p class="a">Hello</p>|
+      assert LazyHTML.to_html(lazy_html) == ~S|<p>Hello</p>|
+    end
+
+    test "copy shared documents" do
+      lazy_html = LazyHTML.from_fragment(~S|<div><p>Hello</p><p>world</p></div>|)
+      paragraphs = LazyHTML.query(lazy_html, "p")
+
+      result = LazyHTML.set_text(paragraphs, "x")
+
+      assert LazyHTML.to_html(result) == "<p>x</p><p>x</p>"
+      assert result |> LazyHTML.document() |> LazyHTML.to_html() == "<div><p>x</p><p>x</p></div>"
+      assert inspect(result) =~ "(from selector)"
+
+      assert LazyHTML.to_html(lazy_html) == "<div><p>Hello</p><p>world</p></div>"
+      assert LazyHTML.to_html(paragraphs) == "<p>Hello</p><p>world</p>"
+    end
+
+    test "keep the doctype" do
+      lazy_html = LazyHTML.from_document(~S|<!DOCTYPE html><html><body><p>Hello</p></body></html>|)
+      assert Enum.count(lazy_html) == 2
+
+      result = lazy_html |> LazyHTML.query("p") |> LazyHTML.set_text("x")
+      document = LazyHTML.document(result)
+
+      assert Enum.count(document) == 2
+      assert LazyHTML.to_html(document) == "<html><head></head><body><p>x</p></body></html>"
+      assert lazy_html |> LazyHTML.set_attribute("lang", "en") |> Enum.count() == 2
+    end
+
+    test "do not affect trees built before" do
+      lazy_html = LazyHTML.from_fragment(~S|<p title="a">Hello</p>|)
+      tree = LazyHTML.to_tree(lazy_html)
+
+      result = lazy_html |> LazyHTML.set_attribute("title", "b") |> LazyHTML.set_text("x")
+
+      assert LazyHTML.to_html(result) == ~S|<p title="b">x</p>|
+      assert tree == [{"p", [{"title", "a"}], ["Hello"]}]
+    end
+
+    test "do not affect streams in progress" do
+      html = String.duplicate("<p>Hello</p>", 1000)
+      lazy_html = LazyHTML.from_fragment(html)
+
+      stream = LazyHTML.NIF.to_html_stream_new(lazy_html, false, 100, false)
+      assert {:cont, chunks} = LazyHTML.NIF.to_html_stream_next(stream)
+
+      result = LazyHTML.set_text(lazy_html, "x")
+      assert LazyHTML.to_html(result) == String.duplicate("<p>x</p>", 1000)
+
+      assert IO.iodata_to_binary([chunks | rest_chunks(stream)]) == html
+    end
+
+    test "build separate indexes for modified documents" do
+      lazy_html = LazyHTML.from_fragment(~S|<div><p id="a">Hello</p></div>|)
+      assert lazy_html |> LazyHTML.query_by_id("a") |> LazyHTML.tag() == ["p"]
+
+      for _ <- 1..5 do
+        assert lazy_html |> LazyHTML.query("#a") |> LazyHTML.tag() == ["p"]
+      end
+
+      result = LazyHTML.append_html(lazy_html, ~S|<span id="b">world</span>|)
+
+      assert result |> LazyHTML.query_by_id("b") |> LazyHTML.tag() == ["span"]
+      assert lazy_html |> LazyHTML.query_by_id("b") |> LazyHTML.tag() == []
+
+      for _ <- 1..5 do
+        assert result |> LazyHTML.query("#b") |> LazyHTML.tag() == ["span"]
+        assert lazy_html |> LazyHTML.query("#b") |> LazyHTML.tag() == []
+      end
+
+      assert LazyHTML.to_html(lazy_html) == ~S|<div><p id="a">Hello</p></div>|
+    end
+
+    test "modify/2 applies modifications in order to a single copy" do
+      lazy_html =
+        LazyHTML.from_fragment(~S|<ul><li class="a">One</li><li>Two</li></ul><p>Hello</p>|)
+
+      selector = LazyHTML.Selector.compile("li")
+
+      modifications = [
+        {".a", :remove},
+        {selector, {:set_attribute, "class", "b"}},
+        {"ul", {:append_html, "<li>Three</li>"}},
+        {"p", {:set_text, "Bye"}},
+        {"li.b", {:replace_with_html, "<li>2</li>"}},
+        {:remove_attribute, "id"}
+      ]
+
+      result = LazyHTML.modify(lazy_html, modifications)
+
+      assert LazyHTML.to_html(result) == "<ul><li>2</li><li>Three</li></ul><p>Bye</p>"
+      assert Enum.count(result) == 2
+
+      assert LazyHTML.to_html(lazy_html) ==
+               ~S|<ul><li class="a">One</li><li>Two</li></ul><p>Hello</p>|
+
+      sequential =
+        lazy_html
+        |> LazyHTML.query(".a")
+        |> LazyHTML.remove()
+        |> LazyHTML.document()
+        |> LazyHTML.query("li")
+        |> LazyHTML.set_attribute("class", "b")
+        |> LazyHTML.document()
+        |> LazyHTML.query("ul")
+        |> LazyHTML.append_html("<li>Three</li>")
+        |> LazyHTML.document()
+        |> LazyHTML.query("p")
+        |> LazyHTML.set_text("Bye")
+        |> LazyHTML.document()
+        |> LazyHTML.query("li.b")
+        |> LazyHTML.replace_with_html("<li>2</li>")
+        |> LazyHTML.document()
+
+      assert LazyHTML.to_html(sequential) == LazyHTML.to_html(result)
+    end
+
+    test "modify/2 with no modifications copies the document" do
+      lazy_html = LazyHTML.from_fragment(~S|<p>Hello</p>|)
+      result = LazyHTML.modify(lazy_html, [])
+
+      assert LazyHTML.to_html(result) == LazyHTML.to_html(lazy_html)
+    end
+
+    test "modify/2 raises on invalid modifications" do
+      lazy_html = LazyHTML.from_fragment(~S|<p>Hello</p>|)
+
+      assert_raise ArgumentError, ~r/invalid modification/, fn ->
+        LazyHTML.modify(lazy_html, [{:set_attribute, "class"}])
+      end
+
+      assert_raise ArgumentError, ~r/invalid modification/, fn ->
+        LazyHTML.modify(lazy_html, [{"p", {"b", :remove}}])
+      end
+    end
+
+    test "remove_attribute/2" do
+      lazy_html = LazyHTML.from_fragment(~S|<p class="a" hidden>Hello</p> text|)
+      result = LazyHTML.remove_attribute(lazy_html, "hidden")
+
+      assert LazyHTML.to_html(result) == ~S|<p class="a">Hello</p> text|
+    end
+
+    test "replace_with_html/2 parses in the context of the parent" do
+      lazy_html = LazyHTML.from_fragment("<table><tr><td>1</td></tr></table>")
+
+      result =
+        lazy_html
+        |> LazyHTML.query("td")
+        |> LazyHTML.replace_with_html("<td>2</td><td>3</td>")
+        |> LazyHTML.document()
+
+      assert LazyHTML.to_html(result) ==
+               "<table><tbody><tr><td>2</td><td>3</td></tr></tbody></table>"
+    end
+
+    test "append_html/2 and set_text/2 handle templates" do
+      lazy_html = LazyHTML.from_fragment("<template><p>1</p></template>")
+
+      result = LazyHTML.append_html(lazy_html, "<p>2</p>")
+      assert LazyHTML.to_html(result) == "<template><p>1</p><p>2</p></template>"
+
+      result = LazyHTML.set_text(result, "x")
+      assert LazyHTML.to_html(result) == "<template>x</template>"
+    end
+
+    test "set_text/2 replaces text and comment content" do
+      lazy_html = LazyHTML.from_fragment("<p>Hello<!-- a --></p>")
+
+      result =
+        lazy_html |> LazyHTML.child_nodes() |> LazyHTML.set_text("x & y") |> LazyHTML.document()
+
+      assert LazyHTML.to_html(result) == "<p>x &amp; y<!--x & y--></p>"
+    end
+
+    test "update memory of modified documents" do
+      lazy_html = LazyHTML.from_fragment("<div></div>")
+      memory = LazyHTML.memory(lazy_html)
+
+      result = LazyHTML.append_html(lazy_html, String.duplicate("<p>Hello</p>", 10_000))
+
+      assert LazyHTML.memory(result) > memory
+    end
+  end
+
+  describe "memory/1" do
+    test "grows with the document size" do
+      small = LazyHTML.from_fragment("<p>Hello</p>")
+      large = LazyHTML.from_fragment(String.duplicate("<p>Hello</p>", 10_000))
+
+      assert LazyHTML.memory(small) > 0
+      assert LazyHTML.memory(large) > LazyHTML.memory(small)
+    end
+
+    test "includes the selector index" do
+      lazy_html =
+        LazyHTML.from_fragment(String.duplicate(~S|<p class="a">Hello</p>|, 10_000))
+
+      memory = LazyHTML.memory(lazy_html)
+
+      for _ <- 1..5 do
+        assert lazy_html |> LazyHTML.query(".a") |> Enum.count() == 10_000
+      end
+
+      assert LazyHTML.memory(lazy_html) > memory
+    end
+  end
+
+  describe "memory/0" do
+    test "counts referenced documents" do
+      %{documents: documents, bytes: bytes} = LazyHTML.memory()
+      assert documents >= 0 and bytes >= 0
+
+      lazy_html = LazyHTML.from_fragment(String.duplicate("<p>Hello</p>", 10_000))
+      assert LazyHTML.memory().bytes >= LazyHTML.memory(lazy_html)
+      assert LazyHTML.memory().documents >= 1
+    end
   end
 
   describe "Inspect protocol" do
@@ -458,6 +1216,31 @@ defmodule LazyHTMLTest do
 
       assert LazyHTML.to_html(span2) == ~S|<span>world</span>|
     end
+
+    test "Enum.at/2, Enum.take/2 and Enum.slice/2 with step" do
+      html = Enum.map_join(1..1000, &"<span>#{&1}</span>")
+      lazy_html = LazyHTML.from_fragment(html)
+
+      assert lazy_html |> Enum.at(0) |> LazyHTML.text() == "1"
+      assert lazy_html |> Enum.at(999) |> LazyHTML.text() == "1000"
+      assert lazy_html |> Enum.at(-1) |> LazyHTML.text() == "1000"
+      assert Enum.at(lazy_html, 1000) == nil
+
+      assert lazy_html |> Enum.take(3) |> Enum.map(&LazyHTML.text/1) == ["1", "2", "3"]
+      assert lazy_html |> Enum.take(-2) |> Enum.map(&LazyHTML.text/1) == ["999", "1000"]
+
+      assert lazy_html |> Enum.slice(0..9//4) |> Enum.map(&LazyHTML.text/1) == ["1", "5", "9"]
+    end
+
+    test "Enum.reduce/3 over many nodes" do
+      html = Enum.map_join(1..1000, &"<span>#{&1}</span>")
+      lazy_html = LazyHTML.from_fragment(html)
+
+      assert Enum.map(lazy_html, &LazyHTML.text/1) == Enum.map(1..1000, &to_string/1)
+
+      assert lazy_html |> Stream.map(&LazyHTML.text/1) |> Enum.zip(1..3) ==
+               [{"1", 1}, {"2", 2}, {"3", 3}]
+    end
   end
 
   describe "Access behaviour" do
@@ -478,4 +1261,23 @@ defmodule LazyHTMLTest do
              """
     end
   end
+
+  defp random_text(size) do
+    # Special characters separated by runs of regular characters of
+    # varying length, so that they land at every offset within and
+    # across vector-sized blocks.
+    specials = ~c" \t\n\r<>&\"'"
+
+    for _ <- 1..size//1, into: "" do
+      run = String.duplicate(Enum.random(["a", "€", " "]), :rand.uniform(40) - 1)
+      run <> <<Enum.random(specials)>>
+    end
+  end
+
+  defp rest_chunks(stream) do
+    case LazyHTML.NIF.to_html_stream_next(stream) do
+      {:cont, chunks} -> [chunks | rest_chunks(stream)]
+      {:done, chunks} -> [chunks]
+    end
+  end
 end